@@ -113,14 +113,17 @@ paddr_t ram_getfirstfree(void);
 /*
  * TLB shootdown bits.
  *
+ * A shootdown names one page of one address space by its ASID, and
+ * the ASID generation so that a cpu which has since flushed (and may
+ * have handed the ASID to someone else) knows to leave it alone.
+ *
  * We'll take up to 16 invalidations before just flushing the whole TLB.
  */
 
 struct tlbshootdown {
-	/*
-	 * Change this to what you need for your VM design.
-	 */
-	int ts_placeholder;
+	uint32_t ts_asid;
+	uint32_t ts_asidgen;
+	vaddr_t ts_vaddr;
 };
 
 #define TLBSHOOTDOWN_MAX 16
@@ -216,6 +216,45 @@ syscall(struct trapframe *tf)
 			sys_execv((char *)tf->tf_a0, (char **) tf->tf_a1, &err);
 		break;
 
+		case SYS_sbrk:
+			err = sys_sbrk((intptr_t)tf->tf_a0, &retval);
+		break;
+
+		case SYS_mmap:
+		{
+			/*
+			 * The file handle and the 64-bit offset are on
+			 * the stack, past the four register arguments;
+			 * the offset is aligned to 8 bytes.
+			 */
+			int fd;
+			off_t offset;
+
+			err = copyin((userptr_t)tf->tf_sp + 16,
+				     &fd, sizeof(int));
+			if (err) {
+				break;
+			}
+			err = copyin((userptr_t)tf->tf_sp + 24,
+				     &offset, sizeof(off_t));
+			if (err) {
+				break;
+			}
+			err = sys_mmap((userptr_t)tf->tf_a0, tf->tf_a1,
+				       tf->tf_a2, tf->tf_a3, fd, offset,
+				       &retval);
+		}
+		break;
+
+		case SYS_munmap:
+			err = sys_munmap((userptr_t)tf->tf_a0, tf->tf_a1);
+		break;
+
+		case SYS_msync:
+			err = sys_msync((userptr_t)tf->tf_a0, tf->tf_a1,
+					tf->tf_a2);
+		break;
+
 	    default:
 		kprintf("Unknown syscall %d\n", callno);
 		err = ENOSYS;
@@ -222,9 +222,8 @@ cpu_irqoff(void)
 }
 
 /*
- * Used below.
+ * Used below, and by the idle loop in thread_switch.
  */
-static
 void
 cpu_irqonoff(void)
 {
@@ -66,7 +66,8 @@ static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
 void
 vm_bootstrap(void)
 {
-	/* Do nothing. */
+	/* Size kmalloc's tables for everything up to the end of RAM. */
+	kheap_bootstrap(ram_stealmem(0) + ram_getsize());
 }
 
 static
@@ -103,6 +104,13 @@ free_kpages(vaddr_t addr)
 	(void)addr;
 }
 
+bool
+vm_idlezero(void)
+{
+	/* No free frames to zero. */
+	return false;
+}
+
 void
 vm_tlbshootdown_all(void)
 {
@@ -5,16 +5,71 @@
 #include <spinlock.h>
 #include <proc.h>
 #include <current.h>
+#include <thread.h>
 #include <mips/tlb.h>
+#include <platform/maxcpus.h>
+#include <cpu.h>
 #include <addrspace.h>
 #include <vm.h>
+#include <kmemcache.h>
+#include <pagetable.h>
+#include <swap.h>
+#include <pagecache.h>
+#include <pageout.h>
 #include <syscall.h>
 
-#define unused 0
-#define used 1
-
 unsigned int TOTAL_PAGES;
-struct pt_entry *page_table;
+cme_t *coremap;
+paddr_t coremap_base;
+
+/*
+ * Free frames are kept by a buddy allocator over coremap indices. A
+ * free block of order k is 2^k frames starting at an index that is a
+ * multiple of 2^k; its buddy is the block at index ^ 2^k. There is
+ * one list of free blocks per order, linked through the first word
+ * of each block's first frame, so allocating or freeing a single
+ * page never looks at more than BUDDY_MAXORDER entries.
+ */
+#define BUDDY_MAXORDER 10
+
+struct buddy_link {
+	struct buddy_link *bl_next;
+	struct buddy_link *bl_prev;
+};
+
+static struct buddy_link *buddy_lists[BUDDY_MAXORDER + 1];
+static unsigned int buddy_nfree;	// frames on all the lists
+
+/*
+ * coremap_lock protects the buddy lists and the coremap words. To
+ * keep CPUs from fighting over it, each CPU also keeps a small cache
+ * of free single frames that it refills from, and flushes back to,
+ * the buddy lists FC_BATCH frames at a time. Cached frames are marked
+ * free but aren't block heads, so the buddy code never merges them;
+ * while a frame is in a cache only that cache's owner writes its word.
+ */
+#define FC_SIZE		16
+#define FC_BATCH	8
+
+struct framecache {
+	struct spinlock fc_lock;
+	unsigned int fc_count;
+	unsigned int fc_frames[FC_SIZE];	// coremap indices
+};
+
+struct spinlock coremap_lock = SPINLOCK_INITIALIZER;
+static struct framecache framecaches[MAXCPUS];
+
+/*
+ * Fault and TLB counters (see vm.h), kept per CPU so counting doesn't
+ * need a lock; a thread that migrates mid-increment can lose a count,
+ * which is fine for statistics.
+ */
+static struct vmstats vmstats[MAXCPUS];
+
+#define VMSTAT_INC(field) (vmstats[curcpu->c_number].field++)
+
+static void buddy_free_run(unsigned int i, unsigned int npages);
 
 void vm_bootstrap(void) {
 	ram_bootstrap();
@@ -22,104 +77,1141 @@ void vm_bootstrap(void) {
 	if(ram_size % PAGE_SIZE)
 		panic("Ram not page size aligned");
 	
-	// allocate space in ram for the page table
-	// and mark its ending location
+	// allocate space in ram for the coremap, one word per frame
 	unsigned long size;
 	TOTAL_PAGES = ram_size / PAGE_SIZE;		
-	size = TOTAL_PAGES * sizeof(struct pt_entry);
+	size = TOTAL_PAGES * sizeof(cme_t);
 	size = ROUNDUP(size, PAGE_SIZE); 	
-	// take ram space for page table
-	paddr_t ptbase_addr = ram_stealmem(size/PAGE_SIZE);
-	if(ptbase_addr == 0)
+	paddr_t cmbase_addr = ram_stealmem(size/PAGE_SIZE);
+	if(cmbase_addr == 0)
 		panic("page_size * npages > ramsize");
-	page_table = (struct pt_entry *) PADDR_TO_KVADDR(ptbase_addr);
-	// map physical frames to page table minus what's allocated
-	// for the page table
+	coremap = (cme_t *) PADDR_TO_KVADDR(cmbase_addr);
+	// the rest of ram is ours to manage, minus what the coremap
+	// itself took
 	TOTAL_PAGES -= (size/PAGE_SIZE);
+	coremap_base = ram_stealmem(TOTAL_PAGES);
+	if(coremap_base == 0)
+		panic("ram");
 	unsigned int i;
 	for(i = 0; i < TOTAL_PAGES; i++) {
-		page_table[i].p_addr = ram_stealmem(1);
-		if(page_table[i].p_addr == 0)
-			panic("ram");
-		page_table[i].state = unused;
-		page_table[i].next = NULL;
+		coremap[i] = CM_FREE;
+	}
+	buddy_free_run(0, TOTAL_PAGES);
+	// pt_cpus is a bitmask of CPU numbers
+	COMPILE_ASSERT(MAXCPUS <= 32);
+	for(i = 0; i < MAXCPUS; i++) {
+		spinlock_init(&framecaches[i].fc_lock);
+		framecaches[i].fc_count = 0;
 	}
+	// kmalloc can now get pages; let it size its tables to match
+	kheap_bootstrap(CM_PADDR(TOTAL_PAGES));
 }
 
-// used by kmalloc
-vaddr_t
-alloc_kpages(unsigned npages)
+// frames are handed to the coremap in one contiguous range, so the
+// entry for a frame can be found without searching
+static
+unsigned int
+coremap_index(paddr_t paddr)
 {
 	unsigned int i;
-	unsigned int count = 0;
-	for(i = 0; i < TOTAL_PAGES; i++) {
-		if(page_table[i].state == unused) {
-			count++;
-			if(count == npages) {
-				unsigned int j;
-				unsigned int first_block = i - (npages - 1);
-				for(j = first_block; j < i; j++) {
-					page_table[j].next = &page_table[j+1];
-					page_table[j].state = used;
-				}
-				page_table[j].state = used;
-				return PADDR_TO_KVADDR(page_table[first_block].p_addr);
-			}
+
+	KASSERT(paddr >= coremap_base);
+	KASSERT((paddr & PAGE_FRAME) == paddr);
+	i = (paddr - coremap_base) / PAGE_SIZE;
+	KASSERT(i < TOTAL_PAGES);
+	return i;
+}
+
+static
+struct buddy_link *
+buddy_link(unsigned int i)
+{
+	return (struct buddy_link *)PADDR_TO_KVADDR(CM_PADDR(i));
+}
+
+static
+void
+buddy_push(unsigned int i, unsigned int order)
+{
+	struct buddy_link *l = buddy_link(i);
+
+	coremap[i] = CM_MKWORD(order, 0, CM_HEAD, CM_FREE);
+	buddy_nfree += 1U << order;
+	l->bl_prev = NULL;
+	l->bl_next = buddy_lists[order];
+	if(l->bl_next != NULL)
+		l->bl_next->bl_prev = l;
+	buddy_lists[order] = l;
+}
+
+// take block I off its free list; the link words are cleared so the
+// frame comes back as zero as free_kpages left it
+static
+void
+buddy_remove(unsigned int i)
+{
+	struct buddy_link *l = buddy_link(i);
+	unsigned int order = CM_HIGH(coremap[i]);
+
+	KASSERT(coremap[i] & CM_HEAD);
+	if(l->bl_prev != NULL)
+		l->bl_prev->bl_next = l->bl_next;
+	else
+		buddy_lists[order] = l->bl_next;
+	if(l->bl_next != NULL)
+		l->bl_next->bl_prev = l->bl_prev;
+	l->bl_next = l->bl_prev = NULL;
+	coremap[i] = CM_FREE;
+	buddy_nfree -= 1U << order;
+}
+
+// return a free, aligned block, merging it with its buddy as far up
+// as possible
+static
+void
+buddy_release(unsigned int i, unsigned int order)
+{
+	unsigned int b;
+
+	while(order < BUDDY_MAXORDER) {
+		b = i ^ (1U << order);
+		if(b + (1U << order) > TOTAL_PAGES ||
+		   coremap[b] != CM_MKWORD(order, 0, CM_HEAD, CM_FREE))
+			break;
+		buddy_remove(b);
+		if(b < i)
+			i = b;
+		order++;
+	}
+	buddy_push(i, order);
+}
+
+// free an arbitrary run of frames by splitting it into the largest
+// aligned blocks that fit
+static
+void
+buddy_free_run(unsigned int i, unsigned int npages)
+{
+	unsigned int j, order;
+
+	for(j = i; j < i + npages; j++)
+		coremap[j] = CM_FREE;
+
+	while(npages > 0) {
+		order = 0;
+		while(order < BUDDY_MAXORDER &&
+		      (i & ((2U << order) - 1)) == 0 &&
+		      (2U << order) <= npages)
+			order++;
+		buddy_release(i, order);
+		i += 1U << order;
+		npages -= 1U << order;
+	}
+}
+
+// take a run of NPAGES frames off the buddy lists; the caller holds
+// coremap_lock. Returns the coremap index, or -1.
+static
+int
+buddy_alloc(unsigned npages)
+{
+	unsigned int i, j, order, k;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+	order = 0;
+	while((1U << order) < npages) {
+		order++;
+		if(order > BUDDY_MAXORDER)
+			return -1;
+	}
+
+	// smallest free block that's big enough
+	for(k = order; k <= BUDDY_MAXORDER; k++) {
+		if(buddy_lists[k] != NULL)
+			break;
+	}
+	if(k > BUDDY_MAXORDER) {
+		// not enough memory
+		return -1;
+	}
+
+	i = coremap_index(KVADDR_TO_PADDR((vaddr_t)buddy_lists[k]));
+	buddy_remove(i);
+
+	// split it down, keeping the front half each time
+	while(k > order) {
+		k--;
+		buddy_push(i + (1U << k), k);
+	}
+
+	coremap[i] = CM_MKWORD(npages, 0, CM_HEAD, CM_KERNEL);
+	for(j = i + 1; j < i + npages; j++)
+		coremap[j] = CM_KERNEL;
+
+	// give back the tail if the request wasn't a power of two
+	if(npages < (1U << order))
+		buddy_free_run(i + npages, (1U << order) - npages);
+
+	return i;
+}
+
+// move up to N frames from FC back to the buddy lists; the caller
+// holds FC's lock
+static
+unsigned int
+framecache_flush(struct framecache *fc, unsigned int n)
+{
+	unsigned int moved = 0;
+
+	spinlock_acquire(&coremap_lock);
+	while(fc->fc_count > 0 && moved < n) {
+		buddy_free_run(fc->fc_frames[--fc->fc_count], 1);
+		moved++;
+	}
+	spinlock_release(&coremap_lock);
+	return moved;
+}
+
+// one free frame from this CPU's cache, refilling it if it's empty.
+// Returns -1 if there are none left anywhere but other CPUs' caches.
+// Before there's a curcpu (early boot) the frame comes straight from
+// the buddy lists, as framecache_put gives it straight back.
+static
+int
+framecache_get(void)
+{
+	struct framecache *fc;
+	int i;
+
+	if(!CURCPU_EXISTS()) {
+		spinlock_acquire(&coremap_lock);
+		i = buddy_alloc(1);
+		spinlock_release(&coremap_lock);
+		return i;
+	}
+	fc = &framecaches[curcpu->c_number];
+
+	spinlock_acquire(&fc->fc_lock);
+	if(fc->fc_count == 0) {
+		spinlock_acquire(&coremap_lock);
+		while(fc->fc_count < FC_BATCH) {
+			i = buddy_alloc(1);
+			if(i < 0)
+				break;
+			coremap[i] = CM_FREE;
+			fc->fc_frames[fc->fc_count++] = i;
 		}
-		else {
-			count = 0;
+		spinlock_release(&coremap_lock);
+	}
+	i = -1;
+	if(fc->fc_count > 0)
+		i = fc->fc_frames[--fc->fc_count];
+	spinlock_release(&fc->fc_lock);
+	return i;
+}
+
+// give a frame back through this CPU's cache
+static
+void
+framecache_put(unsigned int i)
+{
+	struct framecache *fc;
+
+	if(!CURCPU_EXISTS()) {
+		spinlock_acquire(&coremap_lock);
+		buddy_free_run(i, 1);
+		spinlock_release(&coremap_lock);
+		return;
+	}
+	fc = &framecaches[curcpu->c_number];
+
+	spinlock_acquire(&fc->fc_lock);
+	if(fc->fc_count == FC_SIZE)
+		framecache_flush(fc, FC_BATCH);
+	coremap[i] = CM_FREE;
+	fc->fc_frames[fc->fc_count++] = i;
+	spinlock_release(&fc->fc_lock);
+}
+
+// empty every CPU's cache so their frames can be merged into larger
+// blocks or handed to whoever is short. Returns how many came back.
+static
+unsigned int
+framecache_drain(void)
+{
+	unsigned int c, n = 0;
+
+	for(c = 0; c < MAXCPUS; c++) {
+		spinlock_acquire(&framecaches[c].fc_lock);
+		n += framecache_flush(&framecaches[c], FC_SIZE);
+		spinlock_release(&framecaches[c].fc_lock);
+	}
+	return n;
+}
+
+static
+int
+coremap_alloc(unsigned npages)
+{
+	int i;
+
+	if(npages == 1) {
+		i = framecache_get();
+		if(i >= 0)
+			coremap[i] = CM_MKWORD(1, 0, CM_HEAD, CM_KERNEL);
+		return i;
+	}
+
+	spinlock_acquire(&coremap_lock);
+	i = buddy_alloc(npages);
+	spinlock_release(&coremap_lock);
+	return i;
+}
+
+/*
+ * Frames are not cleared when they're freed; only anonymous user
+ * pages need to start out zeroed, and vm_zeroframe is the one place
+ * that does it. A small pool of frames that are already zeroed is
+ * kept for them, filled by CPUs with nothing else to do (see
+ * vm_idlezero), so neither freeing a page nor faulting one in has to
+ * pay for the bzero while the pool lasts. Pool frames are marked free
+ * but aren't block heads, like the per-CPU caches', and go back to
+ * the buddy lists when memory gets tight.
+ */
+#define ZP_SIZE		64
+
+static struct spinlock zeropool_lock = SPINLOCK_INITIALIZER;
+static unsigned int zeropool[ZP_SIZE];	// coremap indices
+static unsigned int zeropool_count;
+
+static
+void
+vm_zeroframe(paddr_t paddr)
+{
+	bzero((void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE);
+}
+
+// called from the idle loop, with interrupts off: zero one free
+// frame into the pool. One page at a time keeps interrupt latency
+// down and lets the caller go back to work as soon as there is some.
+// Returns false once the pool is full or there's no memory to spare.
+bool
+vm_idlezero(void)
+{
+	int i;
+
+	if(zeropool_count >= ZP_SIZE)	// unlocked peek; just a hint
+		return false;
+
+	// straight from the buddy lists, so this CPU's cache, which
+	// faults and kmalloc draw on, is left alone
+	spinlock_acquire(&coremap_lock);
+	i = buddy_alloc(1);
+	spinlock_release(&coremap_lock);
+	if(i < 0)
+		return false;
+	vm_zeroframe(CM_PADDR(i));
+
+	spinlock_acquire(&zeropool_lock);
+	if(zeropool_count == ZP_SIZE) {
+		// another idle CPU filled it first
+		spinlock_release(&zeropool_lock);
+		spinlock_acquire(&coremap_lock);
+		buddy_free_run(i, 1);
+		spinlock_release(&coremap_lock);
+		return false;
+	}
+	coremap[i] = CM_FREE;
+	zeropool[zeropool_count++] = i;
+	spinlock_release(&zeropool_lock);
+	VMSTAT_INC(vs_idlezeroed);
+	return true;
+}
+
+// hand every pooled frame back to the allocator
+static
+unsigned int
+zeropool_drain(void)
+{
+	unsigned int n;
+
+	spinlock_acquire(&zeropool_lock);
+	n = zeropool_count;
+	if(n > 0) {
+		spinlock_acquire(&coremap_lock);
+		while(zeropool_count > 0)
+			buddy_free_run(zeropool[--zeropool_count], 1);
+		spinlock_release(&coremap_lock);
+	}
+	spinlock_release(&zeropool_lock);
+	return n;
+}
+
+// free frames, wherever they're kept. Read without locks, so only
+// good as an estimate.
+unsigned int
+vm_freepages(void)
+{
+	unsigned int c, n;
+
+	n = buddy_nfree + zeropool_count;
+	for(c = 0; c < MAXCPUS; c++)
+		n += framecaches[c].fc_count;
+	return n;
+}
+
+/*
+ * Compaction. A run of frames needs a free block of its size, and
+ * once memory is fragmented there may be none even with plenty of
+ * frames free. Then we pick the aligned window of that size that
+ * holds nothing but free frames and user pages the pager could evict,
+ * and move those pages out to frames elsewhere (swap_relocate) rather
+ * than writing them to disk. The window's free blocks are taken off
+ * the lists first, and each frame that's emptied is held on to, so
+ * nothing else is allocated in the window meanwhile; a held frame is
+ * CM_HELD, which looks like the inside of a kernel run. If anything
+ * else turns up in the window before we're done, the held frames go
+ * back and the allocation fails as it would have before.
+ *
+ * One compaction runs at a time; anyone else asking meanwhile fails.
+ */
+#define CM_HELD		CM_MKWORD(0, 0, 0, CM_KERNEL)
+
+static struct spinlock compact_lock = SPINLOCK_INITIALIZER;
+static bool compacting;
+
+// the window of 2^ORDER frames with the fewest pages to move, or -1
+// if every window has something in it that can't be moved. The caller
+// holds coremap_lock.
+static
+int
+compact_pick(unsigned int order)
+{
+	unsigned int size = 1U << order;
+	unsigned int base, j, moves, best = ~0U;
+	int bestbase = -1;
+	cme_t w;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+	for(base = 0; base + size <= TOTAL_PAGES; base += size) {
+		moves = 0;
+		for(j = base; j < base + size; j++) {
+			w = coremap[j];
+			if(CM_STATE(w) == CM_FREE)
+				continue;
+			if(CM_STATE(w) != CM_USER || CM_LOW(w) == 0)
+				break;
+			moves++;
+		}
+		if(j == base + size && moves < best) {
+			best = moves;
+			bestbase = base;
+		}
+	}
+	return bestbase;
+}
+
+// take a run of NPAGES frames by compacting, as buddy_alloc would
+// give it. Returns the coremap index, or -1.
+static
+int
+coremap_compact(unsigned npages)
+{
+	unsigned int order, size, j, k, n;
+	paddr_t newpa;
+	cme_t w;
+	int base;
+
+	// moving pages sleeps
+	if(!CURCPU_EXISTS() || curthread->t_in_interrupt ||
+	   curcpu->c_spinlocks > 0)
+		return -1;
+
+	order = 0;
+	while((1U << order) < npages) {
+		order++;
+		if(order > BUDDY_MAXORDER)
+			return -1;
+	}
+	size = 1U << order;
+
+	spinlock_acquire(&compact_lock);
+	if(compacting) {
+		spinlock_release(&compact_lock);
+		return -1;
+	}
+	compacting = true;
+	spinlock_release(&compact_lock);
+
+	// the moved pages need somewhere to go; don't make room by
+	// paging out
+	spinlock_acquire(&coremap_lock);
+	base = buddy_nfree >= size ? compact_pick(order) : -1;
+	if(base < 0) {
+		spinlock_release(&coremap_lock);
+		goto fail;
+	}
+	// hold the window's free blocks. A free frame that isn't in a
+	// block here is in some CPU's cache and is left to spoil it.
+	for(j = base; j < base + size; j += n) {
+		w = coremap[j];
+		n = 1;
+		if(w & CM_HEAD && CM_STATE(w) == CM_FREE) {
+			n = 1U << CM_HIGH(w);
+			buddy_remove(j);
+			for(k = j; k < j + n; k++)
+				coremap[k] = CM_HELD;
+		}
+	}
+	spinlock_release(&coremap_lock);
+
+	for(j = base; j < base + size; j++) {
+		if(CM_STATE(coremap[j]) != CM_USER)	// just a peek
+			continue;
+		newpa = alloc_upage();
+		if(newpa == 0)
+			break;
+		if(swap_relocate(j, newpa)) {
+			free_upage(newpa);
+			break;
+		}
+		spinlock_acquire(&coremap_lock);
+		coremap[j] = CM_HELD;
+		spinlock_release(&coremap_lock);
+		VMSTAT_INC(vs_moved);
+	}
+
+	spinlock_acquire(&coremap_lock);
+	for(j = base; j < base + size; j++) {
+		if(coremap[j] != CM_HELD)
+			break;
+	}
+	if(j < base + size) {
+		for(j = base; j < base + size; j++) {
+			if(coremap[j] == CM_HELD)
+				buddy_free_run(j, 1);
 		}
+		spinlock_release(&coremap_lock);
+		goto fail;
 	}
+	coremap[base] = CM_MKWORD(npages, 0, CM_HEAD, CM_KERNEL);
+	if(npages < size)
+		buddy_free_run(base + npages, size - npages);
+	spinlock_release(&coremap_lock);
+
+	VMSTAT_INC(vs_compactions);
+	spinlock_acquire(&compact_lock);
+	compacting = false;
+	spinlock_release(&compact_lock);
+	return base;
+
+    fail:
+	VMSTAT_INC(vs_compactfails);
+	spinlock_acquire(&compact_lock);
+	compacting = false;
+	spinlock_release(&compact_lock);
+	return -1;
+}
+
+// make a free block of at least NPAGES frames by compaction, if there
+// isn't one, and leave it free
+int
+vm_compact(unsigned npages)
+{
+	int i;
 
-	// not enough memory
+	if(npages == 0)
+		return EINVAL;
+	framecache_drain();
+	zeropool_drain();
+	spinlock_acquire(&coremap_lock);
+	i = buddy_alloc(npages);
+	spinlock_release(&coremap_lock);
+	if(i < 0) {
+		i = coremap_compact(npages);
+		if(i < 0)
+			return ENOMEM;
+	}
+	spinlock_acquire(&coremap_lock);
+	buddy_free_run(i, npages);
+	spinlock_release(&coremap_lock);
 	return 0;
 }
 
+// used by kmalloc
+vaddr_t
+alloc_kpages(unsigned npages)
+{
+	int i;
+
+	// when memory is full, first take back what the other CPUs are
+	// holding (free frames, and kmalloc's cached blocks, after
+	// emptying the object caches into those if we may sleep), then drop
+	// cached file pages nobody maps, then push user pages out to
+	// swap one at a time until there's room. Only single pages are
+	// worth evicting for: freeing frames at random is no way to build
+	// a contiguous run, so a run is made by moving pages out of the
+	// way instead. The pageout daemon is meant to keep us from
+	// getting this far.
+	while((i = coremap_alloc(npages)) < 0) {
+		if(framecache_drain() > 0)
+			continue;
+		if(zeropool_drain() > 0)
+			continue;
+		// object destructors may sleep
+		if(CURCPU_EXISTS() && !curthread->t_in_interrupt &&
+		   curcpu->c_spinlocks == 0)
+			kmem_cache_reapall();
+		if(kheap_drain() > 0)
+			continue;
+		if(pagecache_reclaim() > 0)
+			continue;
+		if(npages != 1) {
+			i = coremap_compact(npages);
+			if(i < 0)
+				return 0;
+			break;
+		}
+		if(swap_evict())
+			return 0;
+		VMSTAT_INC(vs_directevicts);
+	}
+	if(vm_freepages() < pageout_lowater)
+		pageout_wakeup();
+	return PADDR_TO_KVADDR(CM_PADDR(i));
+}
+
 static
 void
-as_zero_region(paddr_t paddr, unsigned npages)
+coremap_free(unsigned int i, unsigned int npages)
 {
-	bzero((void *)PADDR_TO_KVADDR(paddr), npages * PAGE_SIZE);
+	if(npages == 1) {
+		framecache_put(i);
+		return;
+	}
+	spinlock_acquire(&coremap_lock);
+	buddy_free_run(i, npages);
+	spinlock_release(&coremap_lock);
 }
 
 void
 free_kpages(vaddr_t addr)
 {
-	// need to add check before freeing memory
-
 	unsigned int i;
-	for(i = 0; i < TOTAL_PAGES; i++) {
-		if(page_table[i].p_addr == KVADDR_TO_PADDR(addr)) 
-			break;
+	cme_t w;
+
+	i = coremap_index(KVADDR_TO_PADDR(addr));
+	w = coremap[i];
+	KASSERT(CM_STATE(w) == CM_KERNEL);
+	KASSERT(w & CM_HEAD);
+	coremap_free(i, CM_HIGH(w));
+}
+
+// single frames for user pages come out of the same pool as the
+// kernel heap. A new frame has one mapping and no owner yet; nobody
+// else can see it, so no lock is needed to say so.
+paddr_t
+alloc_upage(void)
+{
+	vaddr_t kva;
+	paddr_t paddr;
+
+	kva = alloc_kpages(1);
+	if(kva == 0)
+		return 0;
+	paddr = KVADDR_TO_PADDR(kva);
+	coremap[coremap_index(paddr)] = CM_MKWORD(0, 0, 0, CM_USER);
+	return paddr;
+}
+
+// a frame for a new anonymous page, already zeroed
+paddr_t
+alloc_zpage(void)
+{
+	paddr_t paddr;
+	int i = -1;
+
+	spinlock_acquire(&zeropool_lock);
+	if(zeropool_count > 0)
+		i = zeropool[--zeropool_count];
+	spinlock_release(&zeropool_lock);
+	if(i >= 0) {
+		coremap[i] = CM_MKWORD(0, 0, 0, CM_USER);
+		VMSTAT_INC(vs_prezeroed);
+		return CM_PADDR(i);
 	}
+
+	paddr = alloc_upage();
+	if(paddr != 0)
+		vm_zeroframe(paddr);
+	return paddr;
+}
+
+// another page table now maps this frame (copy-on-write sharing)
+void
+upage_incref(paddr_t paddr)
+{
+	unsigned int i = coremap_index(paddr);
+	unsigned int n;
+
+	spinlock_acquire(&coremap_lock);
+	switch(CM_STATE(coremap[i])) {
+	    case CM_USER:
+		// a shared frame has no single page table to update, so
+		// it stays resident until one side claims it in vm_fault
+		n = 2;
+		break;
+	    case CM_SHARED:
+		n = CM_LOW(coremap[i]) + 1;
+		KASSERT(n <= CM_LOWMAX);
+		break;
+	    default:
+		panic("upage_incref: frame 0x%x not a user page\n", paddr);
+	}
+	coremap[i] = CM_MKWORD(0, n, 0, CM_SHARED);
+	spinlock_release(&coremap_lock);
+}
+
+// true if more than one page table (or the page cache) holds the frame
+bool
+upage_shared(paddr_t paddr)
+{
+	return CM_STATE(coremap[coremap_index(paddr)]) == CM_SHARED;
+}
+
+static
+void
+coremap_setowner(unsigned int i, struct pagetable *pt, vaddr_t vaddr)
+{
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+	KASSERT(CM_STATE(coremap[i]) == CM_USER);
+	if(CM_LOW(coremap[i]) == 0)
+		swap_mapped(i);
+	coremap[i] = CM_MKWORD(vaddr >> 12, pt->pt_slot, CM_REF, CM_USER);
+}
+
+// the frame is mapped, unshared, at VADDR in PT; make it a candidate
+// for eviction and mark it recently used
+void
+upage_setowner(paddr_t paddr, struct pagetable *pt, vaddr_t vaddr)
+{
+	unsigned int i = coremap_index(paddr);
+
+	spinlock_acquire(&coremap_lock);
+	coremap_setowner(i, pt, vaddr);
+	spinlock_release(&coremap_lock);
+}
+
+// upage_setowner for vm_fault, which looked at *PTE without holding
+// anything the pager respects: only if *PTE still maps PADDR as a
+// private page. Returns false if the page has been evicted or moved
+// since. Call at splhigh; then a pager that unmaps the page after the
+// check can't finish its TLB shootdown, and so can't free the frame,
+// until the caller has loaded its entry and lowered spl again.
+static
+bool
+upage_claim(pte_t *pte, paddr_t paddr, struct pagetable *pt, vaddr_t vaddr)
+{
+	spinlock_acquire(&coremap_lock);
+	if((*pte & (PTE_FRAME | PTE_VALID | PTE_COW | PTE_FILE)) !=
+	    (paddr | PTE_VALID)) {
+		spinlock_release(&coremap_lock);
+		return false;
+	}
+	coremap_setowner(coremap_index(paddr), pt, vaddr);
+	spinlock_release(&coremap_lock);
+	return true;
+}
+
+// drop one mapping of the frame; the last one frees it
+void
+free_upage(paddr_t paddr)
+{
+	unsigned int i = coremap_index(paddr);
+	unsigned int n;
+
+	spinlock_acquire(&coremap_lock);
+	switch(CM_STATE(coremap[i])) {
+	    case CM_USER:
+		coremap[i] = CM_MKWORD(1, 0, CM_HEAD, CM_KERNEL);
+		spinlock_release(&coremap_lock);
+		coremap_free(i, 1);
+		return;
+	    case CM_SHARED:
+		n = CM_LOW(coremap[i]) - 1;
+		if(n == 1)
+			coremap[i] = CM_MKWORD(0, 0, 0, CM_USER);
+		else
+			coremap[i] = CM_MKWORD(0, n, 0, CM_SHARED);
+		break;
+	    default:
+		panic("free_upage: frame 0x%x not a user page\n", paddr);
+	}
+	spinlock_release(&coremap_lock);
+}
+
+void
+vm_getstats(struct vmstats *sum)
+{
+	unsigned c;
+
+	bzero(sum, sizeof(*sum));
+	for(c = 0; c < MAXCPUS; c++) {
+		sum->vs_faults += vmstats[c].vs_faults;
+		sum->vs_refills += vmstats[c].vs_refills;
+		sum->vs_zerofills += vmstats[c].vs_zerofills;
+		sum->vs_swapins += vmstats[c].vs_swapins;
+		sum->vs_filefills += vmstats[c].vs_filefills;
+		sum->vs_textfills += vmstats[c].vs_textfills;
+		sum->vs_cowcopies += vmstats[c].vs_cowcopies;
+		sum->vs_tlbflushes += vmstats[c].vs_tlbflushes;
+		sum->vs_rollovers += vmstats[c].vs_rollovers;
+		sum->vs_preloads += vmstats[c].vs_preloads;
+		sum->vs_directevicts += vmstats[c].vs_directevicts;
+		sum->vs_prezeroed += vmstats[c].vs_prezeroed;
+		sum->vs_idlezeroed += vmstats[c].vs_idlezeroed;
+		sum->vs_compactions += vmstats[c].vs_compactions;
+		sum->vs_compactfails += vmstats[c].vs_compactfails;
+		sum->vs_moved += vmstats[c].vs_moved;
+	}
+}
+
+void
+vm_printstats(void)
+{
+	struct vmstats sum;
+
+	vm_getstats(&sum);
+	kprintf("vm faults:      %u\n", sum.vs_faults);
+	kprintf("  tlb refills:  %u\n", sum.vs_refills);
+	kprintf("  zero-fills:   %u (%u pre-zeroed)\n", sum.vs_zerofills,
+		sum.vs_prezeroed);
+	kprintf("  idle-zeroed:  %u (%u in pool)\n", sum.vs_idlezeroed,
+		zeropool_count);
+	kprintf("  swap-ins:     %u\n", sum.vs_swapins);
+	kprintf("  file pages:   %u\n", sum.vs_filefills);
+	kprintf("  text pages:   %u\n", sum.vs_textfills);
+	kprintf("  cow copies:   %u\n", sum.vs_cowcopies);
+	kprintf("tlb flushes:    %u\n", sum.vs_tlbflushes);
+	kprintf("asid rollovers: %u\n", sum.vs_rollovers);
+	kprintf("tlb preloads:   %u (window %u)\n", sum.vs_preloads,
+		vm_faultaround);
+	kprintf("free frames:    %u of %u\n", vm_freepages(), TOTAL_PAGES);
+	kprintf("direct evicts:  %u\n", sum.vs_directevicts);
+	kprintf("compactions:    %u (%u failed, %u pages moved)\n",
+		sum.vs_compactions, sum.vs_compactfails, sum.vs_moved);
+}
+
+// how badly free memory is broken up. For each request size, the
+// share of the free frames that are in blocks too small for it: 0%
+// means any free frame could be part of such a run, 100% means none
+// can. Frames in the per-CPU caches and the zero pool are counted as
+// single pages.
+void
+vm_printfrag(void)
+{
+	unsigned int nblocks[BUDDY_MAXORDER + 1];
+	unsigned int k, j, nfree, cached, small, largest;
+	struct buddy_link *l;
+
+	cached = zeropool_count;
+	for(j = 0; j < MAXCPUS; j++)
+		cached += framecaches[j].fc_count;
+
+	spinlock_acquire(&coremap_lock);
+	for(k = 0; k <= BUDDY_MAXORDER; k++) {
+		nblocks[k] = 0;
+		for(l = buddy_lists[k]; l != NULL; l = l->bl_next)
+			nblocks[k]++;
+	}
+	nfree = buddy_nfree;
+	spinlock_release(&coremap_lock);
+
+	largest = 0;
+	kprintf("free blocks:   ");
+	for(k = 0; k <= BUDDY_MAXORDER; k++) {
+		kprintf(" %u", nblocks[k]);
+		if(nblocks[k] > 0)
+			largest = 1U << k;
+	}
+	kprintf(" (1 to %u pages)\n", 1U << BUDDY_MAXORDER);
+	kprintf("free frames:    %u in blocks, %u cached\n", nfree, cached);
+	kprintf("largest run:    %u pages\n", largest);
+
+	nfree += cached;
+	if(nfree == 0)
+		return;
+	kprintf("unusable free:  ");
+	small = cached;
+	for(k = 0; k <= BUDDY_MAXORDER; k++) {
+		if(k > 0)
+			small += nblocks[k - 1] << (k - 1);
+		kprintf(" %u%%", (k == 0 ? 0 : small) * 100 / nfree);
+	}
+	kprintf(" (same sizes)\n");
+}
+
+/*
+ * Give the page behind PTE a private, writable frame. If nobody else
+ * shares the frame any more we can simply keep it; otherwise copy it
+ * and drop our reference to the shared one.
+ */
+static
+int
+vm_breakcow(pte_t *pte)
+{
+	paddr_t oldpa, newpa;
+
+	KASSERT((*pte & (PTE_VALID | PTE_COW)) == (PTE_VALID | PTE_COW));
+	oldpa = PTE_PADDR(*pte);
+
+	if(!upage_shared(oldpa)) {
+		*pte &= ~PTE_COW;
+		return 0;
+	}
+
+	newpa = alloc_upage();
+	if(newpa == 0)
+		return ENOMEM;
+	memmove((void *)PADDR_TO_KVADDR(newpa),
+		(const void *)PADDR_TO_KVADDR(oldpa), PAGE_SIZE);
+	*pte = newpa | PTE_VALID;
+	free_upage(oldpa);
+	VMSTAT_INC(vs_cowcopies);
+	return 0;
+}
+
+/*
+ * Address space IDs. A page table is given one of the hardware ASIDs
+ * the first time it's activated in an ASID generation, and its TLB
+ * entries are tagged with it, so switching between processes needs
+ * no flush: each one only sees its own entries. ASID 0 is never
+ * handed out.
+ *
+ * When the ASIDs run out the generation is bumped and everyone starts
+ * over. Page tables from the old generation get a fresh ASID when next
+ * activated, and each CPU flushes its whole TLB the first time it
+ * activates anything in the new generation, so an ASID is never
+ * reused on a CPU that might still hold entries for its old owner.
+ */
+static struct spinlock asid_lock = SPINLOCK_INITIALIZER;
+static uint32_t asid_generation = 1;
+static uint32_t asid_next = 1;
+
+static uint32_t asid_cpugen[MAXCPUS];	// generation each CPU's TLB is in
+static uint32_t asid_current[MAXCPUS];	// ASID loaded on each CPU
+
+// the TLB functions clobber EntryHi; put this CPU's ASID back.
+// Call at splhigh.
+static
+void
+vm_restorepid(void)
+{
+	tlb_setpid(asid_current[curcpu->c_number] << TLBHI_PIDSHIFT);
+}
+
+void
+vm_activate(struct pagetable *pt)
+{
+	uint32_t gen;
+	unsigned c;
+	int i, spl;
+
+	spl = splhigh();
+	c = curcpu->c_number;
+
+	spinlock_acquire(&asid_lock);
+	if(pt->pt_asidgen != asid_generation) {
+		if(asid_next == NUM_ASID) {
+			asid_generation++;
+			asid_next = 1;
+			VMSTAT_INC(vs_rollovers);
+		}
+		pt->pt_asid = asid_next++;
+		pt->pt_asidgen = asid_generation;
+		pt->pt_cpus = 0;
+	}
+	pt->pt_cpus |= 1U << c;
+	gen = pt->pt_asidgen;
+	spinlock_release(&asid_lock);
+
+	if(asid_cpugen[c] != gen) {
+		for(i = 0; i < NUM_TLB; i++)
+			tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+		asid_cpugen[c] = gen;
+		VMSTAT_INC(vs_tlbflushes);
+	}
+	asid_current[c] = pt->pt_asid;
+	vm_restorepid();
+	splx(spl);
+}
+
+// make every TLB entry for PT, on every CPU, unusable. Rather than
+// hunting them down, give PT a new ASID: the old one isn't handed out
+// again until after the next rollover, which flushes everything.
+void
+vm_tlbflush(struct pagetable *pt)
+{
+	struct addrspace *as;
+
+	spinlock_acquire(&asid_lock);
+	pt->pt_asidgen = 0;
+	spinlock_release(&asid_lock);
+
+	as = proc_getas();
+	if(as != NULL && as->as_pt == pt)
+		vm_activate(pt);
+}
+
+// put an entry in the TLB: in the slot already holding NEWEHI if
+// there is one, so the same virtual page never appears twice, else in
+// a free slot, else over a random one. Call at splhigh; clobbers the
+// PID.
+static
+void
+vm_tlbput(uint32_t newehi, uint32_t newelo)
+{
+	uint32_t ehi, elo;
+	int i;
+
+	i = tlb_probe(newehi, 0);
+	if(i >= 0) {
+		tlb_write(newehi, newelo, i);
+		return;
+	}
+
+	for (i=0; i<NUM_TLB; i++) {
+                tlb_read(&ehi, &elo, i);
+                if (elo & TLBLO_VALID) {
+                        continue;
+                }
+                tlb_write(newehi, newelo, i);
+                return;
+        }
 	
-	if(i == TOTAL_PAGES)
+	// replace a TLB entry
+	tlb_random(newehi, newelo);
+}
+
+/*
+ * Load a translation for the running address space into the TLB.
+ */
+static
+void
+vm_tlbload(vaddr_t vaddr, paddr_t paddr, int dirty)
+{
+	uint32_t newelo;
+	int spl;
+
+	newelo = paddr | TLBLO_VALID;
+	if(dirty)
+		newelo |= TLBLO_DIRTY;
+	DEBUG(DB_VM, "vm: 0x%x -> 0x%x\n", vaddr, paddr);
+
+        /* Disable interrupts on this CPU while frobbing the TLB. */
+        spl = splhigh();
+	vm_tlbput(vaddr | asid_current[curcpu->c_number] << TLBHI_PIDSHIFT,
+		  newelo);
+	vm_restorepid();
+	splx(spl);
+}
+
+/*
+ * Fault-around. When vm_faultaround is 2 or more, a fault also loads
+ * entries for the other resident pages of the naturally aligned
+ * window of that many pages around the faulting one, clipped to its
+ * region, so a sequential scan takes one exception per window rather
+ * than one per page. Only pages that are already resident are loaded;
+ * nothing is allocated or read in. Copy-on-write pages are loaded
+ * read-only as usual.
+ *
+ * Preloaded pages don't get their reference bit set, so the clock
+ * only sees pages that were actually faulted on as recently used.
+ */
+unsigned vm_faultaround = 0;
+int vm_fareport = 0;
+
+static
+void
+vm_faultaround_load(struct addrspace *as, vaddr_t faultaddress,
+		    vaddr_t regbase, vaddr_t regtop, int writable)
+{
+	vaddr_t va, start, end;
+	uint32_t asid, elo;
+	unsigned window, n;
+	pte_t *pte;
+	int spl;
+
+	window = vm_faultaround;
+	if(window < 2)
 		return;
+	start = faultaddress & ~(vaddr_t)(window * PAGE_SIZE - 1);
+	end = start + window * PAGE_SIZE;
+	if(start < regbase)
+		start = regbase;
+	if(end > regtop)
+		end = regtop;
+
+	n = 0;
+	// the page table is read at splhigh so an eviction's shootdown
+	// can't slip in between reading an entry and loading it
+	spl = splhigh();
+	asid = asid_current[curcpu->c_number] << TLBHI_PIDSHIFT;
+	for(va = start; va < end; va += PAGE_SIZE) {
+		if(va == faultaddress)
+			continue;
+		pte = pagetable_lookup(as->as_pt, va);
+		if(pte == NULL || (*pte & PTE_VALID) == 0)
+			continue;
+		if(tlb_probe(va | asid, 0) >= 0)
+			continue;
+		elo = PTE_PADDR(*pte) | TLBLO_VALID;
+		// file pages must fault on write to be marked dirty
+		if(writable && (*pte & (PTE_COW | PTE_FILE)) == 0)
+			elo |= TLBLO_DIRTY;
+		vm_tlbput(va | asid, elo);
+		n++;
+	}
+	vm_restorepid();
+	splx(spl);
+
+	as->as_tlbpreloads += n;
+	vmstats[curcpu->c_number].vs_preloads += n;
+}
 
-	int count = 0;
-	struct pt_entry *temp = &page_table[i];	
-	while(temp != NULL) {
-		temp->state = unused;
-		temp = temp->next;
-		count++;	
+void
+vm_tlbinvalidate(struct pagetable *pt, vaddr_t vaddr)
+{
+	int i, spl;
+
+	spl = splhigh();
+	// entries tagged with PT's ASID can only be here if this CPU is
+	// in the generation that ASID belongs to
+	if(pt->pt_asidgen == asid_cpugen[curcpu->c_number]) {
+		i = tlb_probe((vaddr & PAGE_FRAME) |
+			      pt->pt_asid << TLBHI_PIDSHIFT, 0);
+		if(i >= 0)
+			tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+		vm_restorepid();
 	}
-	as_zero_region(page_table[i].p_addr, count);
+	splx(spl);
 }
 
 // deal with TLB
 int vm_fault(int faulttype, vaddr_t faultaddress) {
-	vaddr_t vbase1, vbase2, vtop1, vtop2, stackbase, stacktop;
+	vaddr_t regbase, regtop;
 	paddr_t paddr;
-	int i, writable, complete;
-	uint32_t ehi, elo;
+	int writable, complete, result, dirty, spl;
 	struct addrspace *as;
-	int spl;
+	struct vmregion *vr, *mr;
+	unsigned pgindex;
+	pte_t *pte;
 	
 	faultaddress &= PAGE_FRAME;
 
 	switch(faulttype) {
 		case VM_FAULT_READONLY:
-			sys__exit(0);	
 		case VM_FAULT_READ:
 		case VM_FAULT_WRITE:
 			break;
@@ -143,83 +1235,208 @@ int vm_fault(int faulttype, vaddr_t faultaddress) {
 	}
 
 	 /* Assert that the address space has been set up properly. */
-        KASSERT(as->as_vbase1 != 0);
-        KASSERT(as->as_pbase1 != 0);
-        KASSERT(as->as_npages1 != 0);
-	KASSERT(as->as_vbase2 != 0);
-	KASSERT(as->as_pbase2 != 0);
-	KASSERT(as->as_npages2 != 0);
-        KASSERT(as->as_stackpbase != 0);
-        KASSERT((as->as_vbase1 & PAGE_FRAME) == as->as_vbase1);
-        KASSERT((as->as_pbase1 & PAGE_FRAME) == as->as_pbase1);
-	KASSERT((as->as_vbase2 & PAGE_FRAME) == as->as_vbase2);
-	KASSERT((as->as_pbase2 & PAGE_FRAME) == as->as_pbase2);
-        KASSERT((as->as_stackpbase & PAGE_FRAME) == as->as_stackpbase);
-
-	vbase1 = as->as_vbase1;
-        vtop1 = vbase1 + as->as_npages1 * PAGE_SIZE;
-	vbase2 = as->as_vbase2;
-	vtop2 = vbase2 + as->as_npages2 * PAGE_SIZE;
-        stackbase = USERSTACK - VM_STACKPAGES * PAGE_SIZE;
-        stacktop = USERSTACK;	
+	KASSERT(as->as_pt != NULL);
+
+	// anything not in a region (including the stack's guard page)
+	// is an error
+	vr = as_findregion(as, faultaddress);
+	if(vr == NULL)
+		return EFAULT;
+	writable = vr->vr_writable;
+	regbase = vr->vr_base;
+	regtop = vr->vr_top;
+	mr = vr->vr_type == VR_MMAP ? vr : NULL;
 	complete = as->complete;
-	
-        if (faultaddress >= vbase1 && faultaddress < vtop1) {
-                paddr = (faultaddress - vbase1) + as->as_pbase1;
-		writable = as->writable1;
-        }
-	else if (faultaddress >= vbase2 && faultaddress < vtop2) {
-		paddr = (faultaddress - vbase2) + as->as_pbase2;
-		writable = as->writable2;
-	}
-        else if (faultaddress >= stackbase && faultaddress < stacktop) {
-                paddr = (faultaddress - stackbase) + as->as_stackpbase;
+	// segments are writable until loading is done
+	if(!complete)
 		writable = 1;
-        }
-        else {
-                return EFAULT;
-        }
+
+	// a write to a page we mapped read-only: either a genuinely
+	// read-only segment, or a copy-on-write page
+	if(faulttype == VM_FAULT_READONLY && !writable)
+		return EFAULT;
+
+	// find the page, giving it a zeroed frame on first touch,
+	// bringing it back from swap or finding it in the file
+	result = pagetable_getpte(as->as_pt, faultaddress, &pte);
+	if(result)
+		return result;
+	if(*pte & PTE_MOVING) {
+		// compaction is moving the page; wait for it and let the
+		// access fault again
+		swap_lock_acquire();
+		swap_lock_release();
+		return 0;
+	}
+	VMSTAT_INC(vs_faults);
+	as->as_tlbfaults++;
+	pgindex = 0;
+	if(mr != NULL)
+		pgindex = mr->vr_pgoff +
+			(faultaddress - mr->vr_base) / PAGE_SIZE;
+	if((*pte & (PTE_VALID | PTE_SWAPPED)) == 0 && mr != NULL) {
+		// shared mappings write to the cached page itself;
+		// private ones get it copy-on-write like after fork
+		result = pagecache_getpage(mr->vr_pc, pgindex, &paddr);
+		if(result)
+			return result;
+		*pte = paddr | PTE_VALID | (mr->vr_shared ? PTE_FILE : PTE_COW);
+		VMSTAT_INC(vs_filefills);
+	}
+	else if(*pte & PTE_SWAPPED) {
+		paddr = alloc_upage();
+		if(paddr == 0)
+			return ENOMEM;
+		result = swap_pagein(pte, paddr);
+		if(result) {
+			free_upage(paddr);
+			return result;
+		}
+		VMSTAT_INC(vs_swapins);
+	}
+	else if((*pte & PTE_VALID) == 0) {
+		// program text comes from the executable's page cache,
+		// shared with everyone else running it
+		result = as_textpage(as, vr, faultaddress, &paddr);
+		if(result)
+			return result;
+		if(paddr != 0) {
+			*pte = paddr | PTE_VALID | PTE_COW;
+			VMSTAT_INC(vs_textfills);
+		}
+		else {
+			// zeros, plus the page's part of the executable
+			// if any
+			paddr = alloc_zpage();
+			if(paddr == 0)
+				return ENOMEM;
+			result = as_fillpage(as, vr, faultaddress, paddr);
+			if(result) {
+				free_upage(paddr);
+				return result;
+			}
+			*pte = paddr | PTE_VALID;
+			VMSTAT_INC(vs_zerofills);
+		}
+	}
+	else if((*pte & PTE_COW) == 0) {
+		VMSTAT_INC(vs_refills);
+	}
+
+	// copy the page now if this is a write to a shared one; reads
+	// keep sharing it read-only. If everyone else has let go of it,
+	// just take it back.
+	if((*pte & PTE_COW) && ((writable && faulttype != VM_FAULT_READ) ||
+	    !upage_shared(PTE_PADDR(*pte)))) {
+		result = vm_breakcow(pte);
+		if(result)
+			return result;
+	}
+	paddr = PTE_PADDR(*pte);
+	dirty = writable && !(*pte & PTE_COW);
+	if(*pte & PTE_FILE) {
+		// the page cache owns the frame. Map it writable only once
+		// it's marked dirty, so the first write is noticed.
+		if(writable && faulttype != VM_FAULT_READ)
+			pagecache_dirty(mr->vr_pc, pgindex);
+		dirty = writable && pagecache_isdirty(mr->vr_pc, pgindex);
+	}
 
         /* make sure it's page-aligned */
         KASSERT((paddr & PAGE_FRAME) == paddr);
 
-        /* Disable interrupts on this CPU while frobbing the TLB. */
-        spl = splhigh();
-	for (i=0; i<NUM_TLB; i++) {
-                tlb_read(&ehi, &elo, i);
-                if (elo & TLBLO_VALID) {
-                        continue;
-                }
-                ehi = faultaddress;
-		if(!complete || writable)
-                	elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
-		else
-                	elo = paddr | TLBLO_VALID;
-                DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
-                tlb_write(ehi, elo, i);
-                splx(spl);
-                return 0;
-        }
-	
-	// replace a TLB entry
-	ehi = faultaddress;
-        if(!complete || writable)
-               	elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
-	else
-               	elo = paddr | TLBLO_VALID;
-	tlb_random(ehi, elo);
+	// a private page the pager can take (one that was resident
+	// already) may have been evicted or moved since we looked at it;
+	// if so, fault again. Staying at splhigh until the entry is in
+	// keeps it from going away after the check (see upage_claim).
+	spl = splhigh();
+	if((*pte & (PTE_COW | PTE_FILE)) == 0 &&
+	   !upage_claim(pte, paddr, as->as_pt, faultaddress)) {
+		splx(spl);
+		return 0;
+	}
+	// neighbours first: if they push entries out at random, the one
+	// we actually need must not be among them
+	vm_faultaround_load(as, faultaddress, regbase, regtop, writable);
+	vm_tlbload(faultaddress, paddr, dirty);
 	splx(spl);
 	return 0;
 }
 
 
+/*
+ * Invalidate NPAGES pages starting at START in PT on every CPU that
+ * might have them in its TLB, and wait until they all have. Only CPUs
+ * that have run PT under its current ASID are asked. Call only after
+ * the page table itself no longer maps the pages, or the other CPUs
+ * may fault them straight back in.
+ *
+ * A range too big for one batch is cheaper to drop by retiring PT's
+ * ASID, which needs no IPIs at all. That is only safe while no other
+ * CPU is running PT, which holds when PT's own process is the caller.
+ */
+void
+vm_tlbshootdown_range(struct pagetable *pt, vaddr_t start, unsigned npages)
+{
+	struct tlbshootdown ts[TLBSHOOTDOWN_MAX + 1];
+	uint32_t cpus;
+	struct addrspace *as;
+	unsigned i, n;
+	int spl;
+
+	as = proc_getas();
+	if(npages > TLBSHOOTDOWN_MAX && as != NULL && as->as_pt == pt) {
+		vm_tlbflush(pt);
+		return;
+	}
+	// invalidate here and leave this CPU out of the mask without
+	// moving in between; if we move later, ipi_tlbshootdown_sync
+	// covers whichever CPU we end up on
+	spl = splhigh();
+	for(i = 0; i < npages; i++)
+		vm_tlbinvalidate(pt, start + i * PAGE_SIZE);
+
+	spinlock_acquire(&asid_lock);
+	cpus = pt->pt_cpus & ~(1U << curcpu->c_number);
+	// one more than fits makes the targets flush everything
+	n = npages > TLBSHOOTDOWN_MAX ? TLBSHOOTDOWN_MAX + 1 : npages;
+	for(i = 0; i < n; i++) {
+		ts[i].ts_asid = pt->pt_asid;
+		ts[i].ts_asidgen = pt->pt_asidgen;
+		ts[i].ts_vaddr = start + i * PAGE_SIZE;
+	}
+	spinlock_release(&asid_lock);
+	splx(spl);
+
+	if(cpus != 0)
+		ipi_tlbshootdown_sync(cpus, ts, n);
+}
+
+// called from interprocessor_interrupt, at splhigh
 void
 vm_tlbshootdown_all(void)
 {
+	int i;
+
+	for(i = 0; i < NUM_TLB; i++)
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	vm_restorepid();
+	VMSTAT_INC(vs_tlbflushes);
 }
 
 void
 vm_tlbshootdown(const struct tlbshootdown *ts)
 {
-        (void)ts;
+	int i;
+
+	// if this CPU has moved on to a newer generation it has already
+	// flushed, and the ASID may belong to someone else by now
+	if(ts->ts_asidgen != asid_cpugen[curcpu->c_number])
+		return;
+
+	i = tlb_probe((ts->ts_vaddr & PAGE_FRAME) |
+		      ts->ts_asid << TLBHI_PIDSHIFT, 0);
+	if(i >= 0)
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	vm_restorepid();
 }
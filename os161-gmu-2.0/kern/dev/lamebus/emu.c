@@ -848,10 +848,11 @@ emufs_namefile(struct vnode *v, struct uio *uio)
  */
 static
 int
-emufs_mmap(struct vnode *v)
+emufs_mmap(struct vnode *v, int prot)
 {
 	(void)v;
-	return ENOSYS;
+	(void)prot;
+	return 0;
 }
 
 //////////////////////////////
@@ -1121,7 +1122,7 @@ static const struct vnode_ops emufs_dirops = {
 	.vop_gettype = emufs_dir_gettype,
 	.vop_isseekable = emufs_isseekable,
 	.vop_fsync = emufs_void_op_isdir,
-	.vop_mmap = emufs_void_op_isdir,
+	.vop_mmap = vopfail_mmap_isdir,
 	.vop_truncate = emufs_truncate_isdir,
 	.vop_namefile = emufs_namefile,
 
@@ -231,14 +231,16 @@ sfs_fsync(struct vnode *v)
 }
 
 /*
- * Called for mmap().
+ * Called for mmap(). Only used on regular files; the VM system does
+ * the actual I/O through sfs_read and sfs_write.
  */
 static
 int
-sfs_mmap(struct vnode *v   /* add stuff as needed */)
+sfs_mmap(struct vnode *v, int prot)
 {
 	(void)v;
-	return ENOSYS;
+	(void)prot;
+	return 0;
 }
 
 /*
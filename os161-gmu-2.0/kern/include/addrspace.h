@@ -36,11 +36,56 @@
 
 
 #include <vm.h>
+#include <array.h>
 #include "opt-dumbvm.h"
 
 struct vnode;
+struct pagetable;
+struct pagecache;
 
 
+#if !OPT_DUMBVM
+/*
+ * A region of a user address space: the pages [VR_BASE, VR_TOP) are
+ * a program segment, the heap, the stack or a mapped file. Pages are
+ * given frames in vm_fault on first touch; which kind of region a
+ * page is in says where its contents come from.
+ *
+ * Regions never overlap. The heap starts out empty just past the
+ * highest segment and grows upward until it meets the next region.
+ * The stack reaches down from USERSTACK to its limit, with an
+ * unmapped guard page below; mapped files are placed in the highest
+ * gap below that that will hold them.
+ */
+#define VR_SEGMENT	0
+#define VR_HEAP		1
+#define VR_STACK	2
+#define VR_MMAP		3
+
+struct vmregion {
+	vaddr_t vr_base;
+	vaddr_t vr_top;			// end, page aligned
+	int vr_type;			// VR_*
+	int vr_writable;
+	// VR_SEGMENT: FILESZ bytes at FILEOFF in the executable appear
+	// at FILEVADDR; the rest of the segment is zero
+	vaddr_t vr_filevaddr;
+	off_t vr_fileoff;
+	size_t vr_filesz;
+	// VR_MMAP: page PGOFF of the file appears at VR_BASE
+	unsigned vr_pgoff;
+	int vr_shared;			// MAP_SHARED rather than MAP_PRIVATE
+	struct pagecache *vr_pc;
+};
+
+#ifndef ADDRSPACEINLINE
+#define ADDRSPACEINLINE INLINE
+#endif
+
+DECLARRAY(vmregion, ADDRSPACEINLINE);
+DEFARRAY(vmregion, ADDRSPACEINLINE);
+#endif
+
 /*
  * Address space - data structure associated with the virtual memory
  * space of a process.
@@ -59,16 +104,18 @@ struct addrspace {
         paddr_t as_stackpbase;
 #else
         /* Put stuff here for your VM system */
-	vaddr_t as_vbase1;
-	int writable1;
-        paddr_t as_pbase1;
-        size_t as_npages1;
-	vaddr_t as_vbase2;
-	int writable2;
-        paddr_t as_pbase2;
-        size_t as_npages2;
-        paddr_t as_stackpbase;
+	struct vmregionarray as_regions;	// sorted by address
+	struct vmregion *as_lastregion;	// last one found, or NULL
+	struct vmregion *as_heap;	// set by as_complete_load
+	struct vmregion *as_stack;	// set by as_define_stack
+	struct vnode *as_vn;		// the executable, or NULL
+	struct pagecache *as_textpc;	// as_vn's cache, for read-only segments
+	vaddr_t as_heaptop;		// current break; not page aligned
+	vaddr_t as_stacklimit;		// the stack may grow down to here
+	struct pagetable *as_pt;	// backs all the regions
 	int complete;
+	unsigned as_tlbfaults;		// TLB exceptions taken
+	unsigned as_tlbpreloads;	// entries loaded by fault-around
 #endif
 };
 
@@ -98,18 +145,53 @@ struct addrspace {
  *                the way this works if implementing user-level threads.
  *
  *    as_define_region - set up a region of memory within the address
- *                space.
+ *                space. There may be any number, but they may not
+ *                overlap.
  *
  *    as_prepare_load - this is called before actually loading from an
  *                executable into the address space.
  *
  *    as_complete_load - this is called when loading from an executable
- *                is complete.
+ *                is complete. Sets up the (empty) heap.
  *
  *    as_define_stack - set up the stack region in the address space.
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
  *
+ *    as_define_file - say that the segment at VADDR is backed by
+ *                FILESZ bytes at OFFSET in the executable V, the rest
+ *                of its MEMSZ bytes being zero. Pages are read in by
+ *                as_fillpage on first touch.
+ *
+ *    as_findregion - return the region containing VADDR, or NULL.
+ *                The last region found is tried first, so runs of
+ *                faults in one region don't search at all.
+ *
+ *    as_heaplimit - the address the heap may grow up to: the base of
+ *                the next region up.
+ *
+ *    as_fillpage - give the zeroed frame PADDR the initial contents
+ *                of the page at VADDR in region VR: read in file data
+ *                if it's a file-backed segment, otherwise leave it
+ *                alone.
+ *
+ *    as_textpage - if the page at VADDR in region VR is wholly file
+ *                data in a read-only segment, return the executable's
+ *                cached frame for it in *RET, with a reference for the
+ *                caller, to be mapped copy-on-write. Otherwise *RET
+ *                is 0 and the page should be filled privately.
+ *
+ *    as_mmap   - map NPAGES pages of the file behind PC, starting at
+ *                page PGOFF, somewhere free in the address space, and
+ *                return the address. Takes over the caller's
+ *                reference to PC on success.
+ *
+ *    as_munmap - remove the pages in [VADDR, VADDR+NPAGES pages) from
+ *                whatever mappings they belong to, writing dirty
+ *                shared pages back first.
+ *
+ *    as_msync  - write back the dirty shared pages in the range.
+ *
  * Note that when using dumbvm, addrspace.c is not used and these
  * functions are found in dumbvm.c.
  */
@@ -128,6 +210,24 @@ int               as_define_region(struct addrspace *as,
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
+int               as_define_file(struct addrspace *as, struct vnode *v,
+                                 off_t offset, vaddr_t vaddr,
+                                 size_t memsz, size_t filesz);
+#if !OPT_DUMBVM
+struct vmregion  *as_findregion(struct addrspace *as, vaddr_t vaddr);
+vaddr_t           as_heaplimit(struct addrspace *as);
+int               as_fillpage(struct addrspace *as, struct vmregion *vr,
+                              vaddr_t vaddr, paddr_t paddr);
+int               as_textpage(struct addrspace *as, struct vmregion *vr,
+                              vaddr_t vaddr, paddr_t *ret);
+#endif
+int               as_mmap(struct addrspace *as, size_t npages, int writable,
+                          int shared, struct pagecache *pc, unsigned pgoff,
+                          vaddr_t *ret);
+int               as_munmap(struct addrspace *as, vaddr_t vaddr,
+                            size_t npages);
+int               as_msync(struct addrspace *as, vaddr_t vaddr,
+                           size_t npages);
 
 
 /*
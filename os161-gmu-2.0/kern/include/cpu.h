@@ -35,6 +35,8 @@
 #include <threadlist.h>
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
 
+struct wchan;
+
 
 /*
  * Per-cpu structure
@@ -83,10 +85,17 @@ struct cpu {
 	 * struct tlbshootdown is machine-dependent and might
 	 * reasonably be either an address space and vaddr pair, or a
 	 * paddr, or something else.
+	 *
+	 * Each batch of shootdowns sent to the cpu takes a ticket;
+	 * c_shootdown_done is the last ticket it has finished, and
+	 * senders waiting for that sleep on c_shootdown_wchan.
 	 */
 	uint32_t c_ipi_pending;		/* One bit for each IPI number */
 	struct tlbshootdown c_shootdown[TLBSHOOTDOWN_MAX];
 	int c_numshootdown;
+	unsigned c_shootdown_ticket;	/* Last ticket handed out */
+	unsigned c_shootdown_done;	/* Last ticket processed */
+	struct wchan *c_shootdown_wchan;
 	struct spinlock c_ipi_lock;
 };
 
@@ -123,6 +132,13 @@ void cpu_identify(char *buf, size_t max);
 void cpu_irqoff(void);
 void cpu_irqon(void);
 
+/*
+ * Open a brief window for any pending interrupt to be taken, with
+ * interrupts left off afterwards. For the idle loop, which keeps them
+ * off while it does background work between checks for new threads.
+ */
+void cpu_irqonoff(void);
+
 /*
  * Idle or shut down (respectively) the processor.
  *
@@ -153,6 +169,10 @@ void cpu_halt(void);
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
  * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * ipi_tlbshootdown_sync sends a batch of shootdowns to each cpu in a
+ * mask, one IPI per cpu, and sleeps until all of them have processed
+ * it. The current cpu, if it's in the mask, does its share directly.
+ * Bit N of the mask is cpu number N.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -167,6 +187,8 @@ void cpu_halt(void);
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
 void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
+void ipi_tlbshootdown_sync(uint32_t cpumask,
+			   const struct tlbshootdown *mappings, unsigned n);
 
 void interprocessor_interrupt(void);
 
@@ -0,0 +1,23 @@
+#ifndef _KERN_MMAN_H_
+#define _KERN_MMAN_H_
+
+/*
+ * Constants for mmap(), munmap() and msync().
+ */
+
+/* Protection (PROT_READ is implied; mappings are always readable) */
+#define PROT_NONE     0
+#define PROT_READ     1
+#define PROT_WRITE    2
+#define PROT_EXEC     4
+
+/* Sharing; exactly one of these must be given */
+#define MAP_SHARED    1      /* writes go to the file and other mappers */
+#define MAP_PRIVATE   2      /* writes stay in this process */
+
+/* Flags for msync(); writeback is always synchronous */
+#define MS_ASYNC      1
+#define MS_SYNC       2
+
+
+#endif /* _KERN_MMAN_H_ */
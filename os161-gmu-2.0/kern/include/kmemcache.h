@@ -0,0 +1,57 @@
+#ifndef _KMEMCACHE_H_
+#define _KMEMCACHE_H_
+
+/*
+ * Typed object caches.
+ *
+ * A kmem_cache hands out objects of one size, all of one type. Freed
+ * objects are kept (up to KMEMCACHE_MAX per cache) instead of going
+ * back to kmalloc, still in the state the constructor left them in,
+ * so a busy type pays for kmalloc and its own setup (creating locks,
+ * wait channels, arrays) only when the cache runs dry. Objects must
+ * be freed in that same constructed state: whatever the user changes
+ * besides plain fields it must put back before kmem_cache_free.
+ *
+ * The constructor returns 0 or an errno; both it and the destructor
+ * are optional and run without any spinlock held, so they may sleep.
+ * Cached objects are given back under memory pressure, by allocations
+ * that are themselves allowed to sleep.
+ */
+
+#define KMEMCACHE_MAX	16
+
+struct kmem_cache;
+
+/*
+ * Functions in kmemcache.c:
+ *
+ *    kmem_cache_create  - make a cache of SIZE byte objects. NAME must
+ *                         be a string constant. Returns NULL if out of
+ *                         memory.
+ *
+ *    kmem_cache_destroy - destruct and free the cached objects and the
+ *                         cache. Every object must have been freed.
+ *
+ *    kmem_cache_alloc   - get an object, constructed. Returns NULL if
+ *                         out of memory or the constructor failed.
+ *
+ *    kmem_cache_free    - give back an object from kmem_cache_alloc.
+ *
+ *    kmem_cache_reapall - destruct and free the objects every cache is
+ *                         keeping. Returns how many there were. May
+ *                         sleep.
+ *
+ *    kmem_cache_printstats - print what each cache has done.
+ */
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+				     int (*ctor)(void *obj),
+				     void (*dtor)(void *obj));
+void kmem_cache_destroy(struct kmem_cache *kc);
+void *kmem_cache_alloc(struct kmem_cache *kc);
+void kmem_cache_free(struct kmem_cache *kc, void *obj);
+unsigned kmem_cache_reapall(void);
+void kmem_cache_printstats(void);
+
+
+#endif /* _KMEMCACHE_H_ */
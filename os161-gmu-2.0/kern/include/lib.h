@@ -125,13 +125,30 @@ uint32_t random(void);
  *
  * kheap_nextgeneration, dump, and dumpall do nothing unless heap
  * labeling (for leak detection) in kmalloc.c (q.v.) is enabled.
+ *
+ * kheap_bootstrap sizes the heap's bookkeeping for physical memory
+ * ending at the address given; the VM system calls it at boot.
+ *
+ * kheap_drain gives back the free blocks held in per-CPU caches so
+ * heap pages they were keeping can be freed; it returns how many
+ * pages that freed. kheap_nallocs counts kmalloc calls since boot.
+ *
+ * kheap_profile turns the allocation profiler on and off;
+ * kheap_profprint prints the N call sites holding the most memory
+ * and kheap_profreset starts it over.
  */
 void *kmalloc(size_t size);
 void kfree(void *ptr);
+void kheap_bootstrap(paddr_t topaddr);
 void kheap_printstats(void);
 void kheap_nextgeneration(void);
 void kheap_dump(void);
 void kheap_dumpall(void);
+unsigned kheap_drain(void);
+unsigned kheap_nallocs(void);
+void kheap_profile(bool on);
+void kheap_profreset(void);
+void kheap_profprint(unsigned n);
 
 /*
  * C string functions.
@@ -0,0 +1,72 @@
+#ifndef _PAGECACHE_H_
+#define _PAGECACHE_H_
+
+/*
+ * Page cache for memory-mapped files and executables.
+ *
+ * Every vnode that is mapped somewhere has one page cache, hung off
+ * vn_pagecache, holding the file's pages that have been touched
+ * through a mapping. All processes mapping the file share these
+ * frames: MAP_SHARED mappings point straight at them, and
+ * MAP_PRIVATE mappings point at them copy-on-write. The read-only
+ * segments of a running program are mapped like MAP_PRIVATE ones,
+ * with one reference per address space (see as_textpage).
+ *
+ * The cache holds a reference (in the coremap sense; see vm.h) on
+ * each of its frames and each mapping holds another, so a frame
+ * nobody has mapped is an ordinary unshared user frame with no owner.
+ * Such frames are never picked by the swap clock; instead, when memory
+ * runs short, pagecache_reclaim drops the clean ones.
+ *
+ * A page is marked dirty on the first write fault through a shared
+ * mapping and written back with VOP_WRITE by msync, munmap and when
+ * the last mapping of the file goes away. It stays dirty while anyone
+ * still maps it, since they may hold writable TLB entries for it.
+ */
+
+#include <vm.h>
+
+struct vnode;
+struct pagecache;
+
+/*
+ * Functions in pagecache.c:
+ *
+ *    pagecache_get     - return VN's page cache, creating it if needed,
+ *                        with a new reference to it.
+ *
+ *    pagecache_incref  - add a reference (for a new mapping, e.g. in
+ *                        a forked child).
+ *
+ *    pagecache_release - drop a reference; the last one writes back
+ *                        every dirty page and frees the cache.
+ *
+ *    pagecache_getpage - return the frame holding page INDEX of the
+ *                        file, reading it in if it isn't cached, with
+ *                        a reference for the caller's new mapping.
+ *                        Bytes past end of file read as zero.
+ *
+ *    pagecache_dirty   - mark page INDEX dirty.
+ *
+ *    pagecache_isdirty - true if page INDEX is cached and dirty.
+ *
+ *    pagecache_sync    - write back the dirty pages among the NPAGES
+ *                        starting at START. Pages nobody maps any more
+ *                        become clean.
+ *
+ *    pagecache_reclaim - free up to a few cached pages that are clean
+ *                        and unmapped. Returns how many were freed.
+ *                        Never sleeps.
+ */
+
+int pagecache_get(struct vnode *vn, struct pagecache **ret);
+void pagecache_incref(struct pagecache *pc);
+void pagecache_release(struct pagecache *pc);
+int pagecache_getpage(struct pagecache *pc, unsigned index, paddr_t *ret);
+void pagecache_dirty(struct pagecache *pc, unsigned index);
+bool pagecache_isdirty(struct pagecache *pc, unsigned index);
+int pagecache_sync(struct pagecache *pc, unsigned start, unsigned npages);
+unsigned pagecache_reclaim(void);
+
+
+#endif /* _PAGECACHE_H_ */
@@ -0,0 +1,42 @@
+#ifndef _PAGEOUT_H_
+#define _PAGEOUT_H_
+
+/*
+ * The pageout daemon.
+ *
+ * A kernel thread that keeps some memory free so that faults and
+ * kmalloc seldom have to reclaim frames themselves. alloc_kpages wakes
+ * it whenever the number of free frames drops below pageout_lowater;
+ * it then drops clean page cache pages nobody maps and, once those
+ * run out, pushes user pages out to swap, until pageout_hiwater frames
+ * are free. If it can't get there it backs off for a second rather
+ * than spin; allocation still falls back to reclaiming for itself.
+ */
+
+/*
+ * Functions in pageout.c:
+ *
+ *    pageout_bootstrap  - pick default watermarks and start the
+ *                         daemon. Called once at boot, after swap.
+ *
+ *    pageout_wakeup     - kick the daemon. Never sleeps; may be called
+ *                         with spinlocks held. Does nothing before the
+ *                         daemon exists.
+ *
+ *    pageout_setwater   - set the watermarks, in frames. Returns EINVAL
+ *                         unless 0 < LOW <= HIGH < total frames.
+ *
+ *    pageout_printstats - print the watermarks and what the daemon has
+ *                         done.
+ */
+
+void pageout_bootstrap(void);
+void pageout_wakeup(void);
+int pageout_setwater(unsigned low, unsigned high);
+void pageout_printstats(void);
+
+/* Read unlocked by alloc_kpages */
+extern unsigned pageout_lowater;
+
+
+#endif /* _PAGEOUT_H_ */
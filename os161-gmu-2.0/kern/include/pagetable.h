@@ -0,0 +1,95 @@
+#ifndef _PAGETABLE_H_
+#define _PAGETABLE_H_
+
+/*
+ * Per-process two-level page tables.
+ *
+ * A user virtual address is split into a 10-bit directory index, a
+ * 10-bit table index and the 12-bit offset within the page. The
+ * directory is allocated with the address space; second-level tables
+ * (one page each) are only allocated once something in the 4M they
+ * cover is touched, so a sparse address space stays cheap.
+ *
+ * Each entry is one word: the physical frame in the top 20 bits and
+ * flags in the low 12. While a page is out on the swap disk the top
+ * bits hold its swap slot instead. While compaction is copying a page
+ * to a new frame the entry is just PTE_MOVING, and anyone who finds
+ * it that way waits for the pager's lock and looks again.
+ */
+
+#include <machine/vm.h>
+#include <vm.h>
+
+#define PT_NENTRIES		1024
+#define PT_DIR_INDEX(va)	(((va) >> 22) & 0x3ff)
+#define PT_TBL_INDEX(va)	(((va) >> 12) & 0x3ff)
+
+typedef uint32_t pte_t;
+
+#define PTE_FRAME	0xfffff000	/* physical frame of the page */
+#define PTE_VALID	0x00000001	/* page is resident at PTE_FRAME */
+#define PTE_COW		0x00000002	/* frame is shared; copy before writing */
+#define PTE_SWAPPED	0x00000004	/* page is in swap slot PTE_SLOT */
+#define PTE_FILE	0x00000008	/* frame belongs to a shared file mapping */
+#define PTE_MOVING	0x00000010	/* page is being moved to another frame */
+
+#define PTE_PADDR(pte)	((paddr_t)((pte) & PTE_FRAME))
+#define PTE_SLOT(pte)	((unsigned)((pte) >> 12))
+#define PTE_MKSWAP(slot) ((pte_t)(slot) << 12 | PTE_SWAPPED)
+
+/*
+ * Each live page table has a small slot number so the coremap can
+ * name a frame's owner in a few bits. Slot 0 means "no owner".
+ */
+#define PT_MAXSLOTS		CM_LOWMAX
+
+struct pagetable {
+	pte_t *pt_dir[PT_NENTRIES];	/* second-level tables, or NULL */
+	unsigned pt_slot;		/* 1..PT_MAXSLOTS */
+	uint32_t pt_asid;		/* TLB address space ID */
+	uint32_t pt_asidgen;		/* ASID generation; 0 = none */
+	uint32_t pt_cpus;		/* cpus that used this ASID */
+};
+
+/*
+ * Functions in pagetable.c:
+ *
+ *    pagetable_create  - allocate an empty page table. Returns NULL
+ *                        on out-of-memory or if all slots are taken.
+ *
+ *    pagetable_destroy - free the page table, every frame still
+ *                        mapped by it and its pages' swap slots.
+ *
+ *    pagetable_unmap   - unmap NPAGES pages starting at START, freeing
+ *                        their frames and swap slots and shooting down
+ *                        their TLB entries everywhere.
+ *
+ *    pagetable_lookup  - return the entry for VA, or NULL if the
+ *                        second-level table covering VA doesn't exist.
+ *
+ *    pagetable_getpte  - like pagetable_lookup but allocates the
+ *                        second-level table if needed. Returns ENOMEM
+ *                        if that fails.
+ *
+ *    pagetable_copy    - map every resident page of SRC at the same
+ *                        address in DST, sharing the frame. Both
+ *                        entries are marked PTE_COW so that the first
+ *                        write on either side takes its own copy,
+ *                        except for shared file pages (PTE_FILE),
+ *                        which both sides keep writing to.
+ *                        Swapped-out pages are read back into new
+ *                        frames for DST.
+ *
+ *    pagetable_byslot  - return the page table in slot SLOT.
+ */
+
+struct pagetable *pagetable_create(void);
+void pagetable_destroy(struct pagetable *pt);
+void pagetable_unmap(struct pagetable *pt, vaddr_t start, unsigned npages);
+pte_t *pagetable_lookup(struct pagetable *pt, vaddr_t va);
+int pagetable_getpte(struct pagetable *pt, vaddr_t va, pte_t **ret);
+int pagetable_copy(struct pagetable *src, struct pagetable *dst);
+struct pagetable *pagetable_byslot(unsigned slot);
+
+
+#endif /* _PAGETABLE_H_ */
@@ -9,3 +9,7 @@ extern struct array *cv_table;
 extern struct semaphore *sem_exec;
 extern struct semaphore *sem_runproc;
 extern struct semaphore *sem_proc;
+
+/* Object caches for struct pid_list and fork's trapframe copies */
+extern struct kmem_cache *pidlist_cache;
+extern struct kmem_cache *trapframe_cache;
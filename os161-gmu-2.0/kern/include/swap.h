@@ -0,0 +1,92 @@
+#ifndef _SWAP_H_
+#define _SWAP_H_
+
+/*
+ * Paging to the swap disk.
+ *
+ * Swap lives on the raw second disk (lhd1raw:), divided into
+ * page-sized slots tracked with a bitmap. When the coremap runs dry
+ * alloc_kpages asks swap_evict to push one user page out. The pageout
+ * daemon (see pageout.h) evicts the same way, ahead of need. A page
+ * that is out on disk has PTE_SWAPPED set and its slot number in
+ * place of the frame (see pagetable.h).
+ *
+ * The victim is chosen by a replacement policy, one of:
+ *
+ *    clock - a clock sweep over the coremap, giving pages that have
+ *            been used since the hand last passed a second chance.
+ *            The default.
+ *    fifo  - the page that has been resident longest.
+ *    aging - the page least used lately, judged by a few bits of
+ *            reference history (an approximation of LRU).
+ *
+ * If there is no swap disk the system runs without paging and
+ * allocation simply fails when memory is full, as before.
+ */
+
+#include <pagetable.h>
+
+/*
+ * Functions in swap.c:
+ *
+ *    swap_bootstrap    - open the swap disk. Called once at boot, after
+ *                        devices have been attached.
+ *
+ *    swap_evict        - write one user page out and free its frame.
+ *                        Returns ENOMEM if swapping is off, the swap
+ *                        disk is full, nothing can be evicted, or the
+ *                        caller isn't allowed to sleep.
+ *
+ *    swap_pagein       - read the page PTE refers to into the frame
+ *                        PADDR, release its slot and point PTE at the
+ *                        frame.
+ *
+ *    swap_pagecopy     - read the page PTE refers to into PADDR but
+ *                        leave the slot alone (for fork). Call with
+ *                        the swap lock held.
+ *
+ *    swap_drop         - release the slot of a swapped-out page that
+ *                        is going away.
+ *
+ *    swap_relocate     - move the user page in coremap frame I to the
+ *                        frame NEWPA, which the caller has allocated,
+ *                        and point its page table at the new frame.
+ *                        Frame I is left to the caller as a user frame
+ *                        with no owner. Returns EBUSY if the page can't
+ *                        be moved (it's no longer evictable, or the
+ *                        caller isn't allowed to sleep).
+ *    swap_lock_acquire - keep the pager away while tearing down or
+ *    swap_lock_release   copying a page table whose frames it might
+ *                        otherwise pick.
+ *
+ *    swap_mapped       - tell the policy that coremap frame I has just
+ *                        been given an owner. Call with coremap_lock
+ *                        held.
+ *
+ *    swap_setpolicy    - switch to the policy called NAME. Returns
+ *                        EINVAL if there's no such policy.
+ *
+ *    swap_policyname   - the name of policy number N, or NULL if there
+ *                        are fewer than N+1.
+ *
+ *    swap_curpolicy    - the name of the policy in use.
+ *
+ *    swap_evictions    - the number of pages written out so far.
+ */
+
+void swap_bootstrap(void);
+int swap_evict(void);
+int swap_pagein(pte_t *pte, paddr_t paddr);
+int swap_pagecopy(pte_t pte, paddr_t paddr);
+void swap_drop(pte_t pte);
+int swap_relocate(unsigned i, paddr_t newpa);
+void swap_lock_acquire(void);
+void swap_lock_release(void);
+void swap_mapped(unsigned i);
+int swap_setpolicy(const char *name);
+const char *swap_policyname(unsigned n);
+const char *swap_curpolicy(void);
+unsigned swap_evictions(void);
+
+
+#endif /* _SWAP_H_ */
@@ -77,4 +77,9 @@ void sys__exit(int exitcode);
 pid_t sys_waitpid(pid_t pid, int *status, int options, int *err);
 pid_t sys_getpid(void);
 int sys_execv(char *progname, char **args, int *err);
+int sys_sbrk(intptr_t amount, int *retval);
+int sys_mmap(userptr_t addr, size_t len, int prot, int flags, int fd,
+	     off_t offset, int *retval);
+int sys_munmap(userptr_t addr, size_t len);
+int sys_msync(userptr_t addr, size_t len, int flags);
 #endif /* _SYSCALL_H_ */
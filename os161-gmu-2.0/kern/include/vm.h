@@ -39,21 +39,61 @@
 
 #include <machine/vm.h>
 
+struct pagetable;
+struct spinlock;
+
 /* Fault-type arguments to vm_fault() */
 #define VM_FAULT_READ        0    /* A read was attempted */
 #define VM_FAULT_WRITE       1    /* A write was attempted */
 #define VM_FAULT_READONLY    2    /* A write to a readonly page was attempted*/
 
-// page table entry
-struct pt_entry {
-	paddr_t p_addr;
-	int state;
-	struct pt_entry* next;
-};
+/*
+ * Coremap: one word per managed physical frame. Frame i is at
+ * CM_PADDR(i); the address isn't stored.
+ *
+ *   [31:12]  FREE head: buddy order of the block
+ *            KERNEL head: length of the run in pages
+ *            USER: virtual page number it is mapped at
+ *   [11:4]   USER: owner page table slot (0 if none yet)
+ *            SHARED: number of page tables mapping it
+ *   [3]      first frame of a free block or kernel run
+ *   [2]      USER: referenced since the clock hand last passed
+ *   [1:0]    state
+ *
+ * A USER frame has exactly one mapping. A frame with no owner slot
+ * (freshly allocated, or left over from sharing) is never evicted.
+ */
+typedef uint32_t cme_t;
+
+#define CM_FREE		0
+#define CM_KERNEL	1
+#define CM_USER		2
+#define CM_SHARED	3
+
+#define CM_REF		0x4
+#define CM_HEAD		0x8
+#define CM_LOWMAX	0xff
+
+#define CM_STATE(w)	((w) & 0x3)
+#define CM_LOW(w)	(((w) >> 4) & CM_LOWMAX)
+#define CM_HIGH(w)	((w) >> 12)
+#define CM_MKWORD(high, low, flags, state) \
+	((cme_t)(high) << 12 | (cme_t)(low) << 4 | (flags) | (state))
+
+#define CM_PADDR(i)	(coremap_base + (paddr_t)(i) * PAGE_SIZE)
 
-#define VM_STACKPAGES 18
+// the stack grows a page at a time as it's touched, down to
+// vm_stackpages pages below USERSTACK (fixed for each address space
+// when it's created). The page under that limit is never mapped, so
+// running off the end of the stack faults instead of landing in a
+// mapped file.
+#define VM_STACKPAGES_DEFAULT	256
+#define VM_STACKPAGES_MAX	8192
+extern unsigned vm_stackpages;
 extern unsigned int TOTAL_PAGES;
-extern struct pt_entry *page_table;
+extern cme_t *coremap;
+extern paddr_t coremap_base;
+extern struct spinlock coremap_lock;	// protects coremap words
 
 /* Initialization function */
 void vm_bootstrap(void);
@@ -65,6 +105,63 @@ int vm_fault(int faulttype, vaddr_t faultaddress);
 vaddr_t alloc_kpages(unsigned npages);
 void free_kpages(vaddr_t addr);
 
+/* Allocate/free a single physical frame backing a user page */
+paddr_t alloc_upage(void);
+paddr_t alloc_zpage(void);	/* same, but zero-filled */
+void free_upage(paddr_t paddr);
+void upage_incref(paddr_t paddr);
+void upage_setowner(paddr_t paddr, struct pagetable *pt, vaddr_t vaddr);
+bool upage_shared(paddr_t paddr);
+
+/* Address space IDs and TLB maintenance */
+void vm_activate(struct pagetable *pt);
+void vm_tlbflush(struct pagetable *pt);
+void vm_tlbinvalidate(struct pagetable *pt, vaddr_t vaddr);
+void vm_tlbshootdown_range(struct pagetable *pt, vaddr_t start,
+			   unsigned npages);
+
+/* Roughly how many frames are free */
+unsigned vm_freepages(void);
+
+/* Zero a free frame for later use; called by idle CPUs */
+bool vm_idlezero(void);
+
+/* Free a run of NPAGES frames by moving user pages out of the way */
+int vm_compact(unsigned npages);
+
+/* Fault and TLB counters */
+struct vmstats {
+	unsigned vs_faults;		// calls to vm_fault
+	unsigned vs_refills;		// ...that only reloaded the TLB
+	unsigned vs_zerofills;		// ...that gave a page its first frame
+					//    (zeroed or read from the program)
+	unsigned vs_swapins;		// ...that read a page back from swap
+	unsigned vs_filefills;		// ...that mapped a page of a file
+	unsigned vs_textfills;		// ...that mapped a shared text page
+	unsigned vs_cowcopies;		// ...that copied a shared page
+	unsigned vs_tlbflushes;		// whole-TLB flushes
+	unsigned vs_rollovers;		// ASID generations used up
+	unsigned vs_preloads;		// entries loaded by fault-around
+	unsigned vs_directevicts;	// evictions by allocating threads
+	unsigned vs_prezeroed;		// zero-fills served from the pool
+	unsigned vs_idlezeroed;		// frames zeroed into it while idle
+	unsigned vs_compactions;	// runs assembled by moving pages
+	unsigned vs_compactfails;	// ...or not
+	unsigned vs_moved;		// user pages moved to do it
+};
+
+/* Add up the counters over all CPUs / print them */
+void vm_getstats(struct vmstats *sum);
+void vm_printstats(void);
+
+/* Print the free block sizes and how fragmented free memory is */
+void vm_printfrag(void);
+
+/* Fault-around window in pages (a power of two; 0 or 1 is off) */
+#define VM_FAULTAROUND_MAX 16
+extern unsigned vm_faultaround;
+extern int vm_fareport;		/* print per-process TLB counters at exit */
+
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown_all(void);
 void vm_tlbshootdown(const struct tlbshootdown *);
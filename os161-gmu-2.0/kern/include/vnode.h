@@ -33,6 +33,7 @@
 #include <spinlock.h>
 struct uio;
 struct stat;
+struct pagecache;
 
 
 /*
@@ -57,6 +58,8 @@ struct vnode {
 	void *vn_data;                  /* Filesystem-specific data */
 
 	const struct vnode_ops *vn_ops; /* Functions on this vnode */
+
+	struct pagecache *vn_pagecache; /* Pages of mmapped file, or NULL */
 };
 
 /*
@@ -120,9 +123,12 @@ struct vnode {
  *    vop_fsync       - Force any dirty buffers associated with this file
  *                      to stable storage.
  *
- *    vop_mmap        - Map file into memory. If you implement this
- *                      feature, you're responsible for choosing the
- *                      arguments for this operation.
+ *    vop_mmap        - Check that the file can be mapped into memory
+ *                      with protection PROT (see kern/mman.h). The
+ *                      pages themselves are read and written back by
+ *                      the VM system's page cache with VOP_READ and
+ *                      VOP_WRITE, so a filesystem that supports them
+ *                      need do nothing more than say yes.
  *
  *    vop_truncate    - Forcibly set size of file to the length passed
  *                      in, discarding any excess blocks.
@@ -193,7 +199,7 @@ struct vnode_ops {
 	int (*vop_gettype)(struct vnode *object, mode_t *result);
 	bool (*vop_isseekable)(struct vnode *object);
 	int (*vop_fsync)(struct vnode *object);
-	int (*vop_mmap)(struct vnode *file /* add stuff */);
+	int (*vop_mmap)(struct vnode *file, int prot);
 	int (*vop_truncate)(struct vnode *file, off_t len);
 	int (*vop_namefile)(struct vnode *file, struct uio *uio);
 
@@ -237,7 +243,7 @@ struct vnode_ops {
 #define VOP_GETTYPE(vn, result)         (__VOP(vn, gettype)(vn, result))
 #define VOP_ISSEEKABLE(vn)              (__VOP(vn, isseekable)(vn))
 #define VOP_FSYNC(vn)                   (__VOP(vn, fsync)(vn))
-#define VOP_MMAP(vn /*add stuff */)     (__VOP(vn, mmap)(vn /*add stuff */))
+#define VOP_MMAP(vn, prot)              (__VOP(vn, mmap)(vn, prot))
 #define VOP_TRUNCATE(vn, pos)           (__VOP(vn, truncate)(vn, pos))
 #define VOP_NAMEFILE(vn, uio)           (__VOP(vn, namefile)(vn, uio))
 
@@ -286,9 +292,9 @@ int vopfail_uio_notdir(struct vnode *vn, struct uio *uio);
 int vopfail_uio_isdir(struct vnode *vn, struct uio *uio);
 int vopfail_uio_inval(struct vnode *vn, struct uio *uio);
 int vopfail_uio_nosys(struct vnode *vn, struct uio *uio);
-int vopfail_mmap_isdir(struct vnode *vn /* add stuff */);
-int vopfail_mmap_perm(struct vnode *vn /* add stuff */);
-int vopfail_mmap_nosys(struct vnode *vn /* add stuff */);
+int vopfail_mmap_isdir(struct vnode *vn, int prot);
+int vopfail_mmap_perm(struct vnode *vn, int prot);
+int vopfail_mmap_nosys(struct vnode *vn, int prot);
 int vopfail_truncate_isdir(struct vnode *vn, off_t pos);
 int vopfail_creat_notdir(struct vnode *vn, const char *name, bool excl,
 			 mode_t mode, struct vnode **result);
@@ -45,11 +45,18 @@
 #include <vm.h>
 #include <mainbus.h>
 #include <vfs.h>
+#include <openfile.h>
 #include <device.h>
 #include <syscall.h>
 #include <test.h>
 #include <version.h>
 #include "autoconf.h"  // for pseudoconfig
+#include "opt-dumbvm.h"
+
+#if !OPT_DUMBVM
+#include <swap.h>
+#include <pageout.h>
+#endif
 
 
 /*
@@ -111,6 +118,7 @@ boot(void)
 	thread_bootstrap();
 	hardclock_bootstrap();
 	vfs_bootstrap();
+	openfile_bootstrap();
 	kheap_nextgeneration();
 
 	/* Probe and initialize devices. Interrupts should come on. */
@@ -131,6 +139,12 @@ boot(void)
 	/* Default bootfs - but ignore failure, in case emu0 doesn't exist */
 	vfs_setbootfs("emu0");
 
+#if !OPT_DUMBVM
+	/* Swap, if we have a disk for it, and the pager */
+	swap_bootstrap();
+	pageout_bootstrap();
+#endif
+
 	kheap_nextgeneration();
 
 	/*
@@ -43,6 +43,11 @@
 #include <sfs.h>
 #include <syscall.h>
 #include <test.h>
+#include <synch.h>
+#include <vm.h>
+#include <kmemcache.h>
+#include <swap.h>
+#include <pageout.h>
 #include "opt-synchprobs.h"
 #include "opt-sfs.h"
 #include "opt-net.h"
@@ -375,6 +380,246 @@ cmd_kheapstats(int nargs, char **args)
 	return 0;
 }
 
+/*
+ * Object cache counters. The kmalloc call count at the end, taken
+ * before and after running a program, shows what the caches save.
+ */
+static
+int
+cmd_kmemcaches(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	kmem_cache_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_vmstat(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vm_printstats();
+
+	return 0;
+}
+
+/*
+ * Show how fragmented free memory is. With an argument, first try to
+ * free a run of that many pages by compaction.
+ */
+static
+int
+cmd_frag(int nargs, char **args)
+{
+	int result;
+
+	if (nargs == 2) {
+		result = vm_compact(atoi(args[1]));
+		if (result) {
+			kprintf("frag: %s\n", strerror(result));
+		}
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: frag [pages]\n");
+		return EINVAL;
+	}
+	vm_printfrag();
+
+	return 0;
+}
+
+/*
+ * Set the fault-around window. Also turns on a report of each
+ * process's TLB exceptions when it exits, so windows (including 0)
+ * can be compared on the same program.
+ */
+static
+int
+cmd_faultaround(int nargs, char **args)
+{
+	unsigned pages;
+
+	if (nargs != 2) {
+		kprintf("Usage: fa pages\n");
+		return EINVAL;
+	}
+	pages = atoi(args[1]);
+	if (pages > VM_FAULTAROUND_MAX || (pages & (pages - 1)) != 0) {
+		kprintf("fa: window must be a power of two up to %u\n",
+			VM_FAULTAROUND_MAX);
+		return EINVAL;
+	}
+	vm_faultaround = pages;
+	vm_fareport = 1;
+
+	return 0;
+}
+
+/*
+ * Show the pageout daemon's watermarks and counters, or with two
+ * arguments, set the watermarks (in frames).
+ */
+static
+int
+cmd_pageout(int nargs, char **args)
+{
+	int result;
+
+	if (nargs == 3) {
+		result = pageout_setwater(atoi(args[1]), atoi(args[2]));
+		if (result) {
+			kprintf("po: need 0 < low <= high < %u\n",
+				TOTAL_PAGES);
+			return result;
+		}
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: po [low high]\n");
+		return EINVAL;
+	}
+	pageout_printstats();
+
+	return 0;
+}
+
+/*
+ * Show the page replacement policy in use and the ones available, or
+ * switch to another.
+ */
+static
+int
+cmd_replpolicy(int nargs, char **args)
+{
+	const char *name;
+	unsigned i;
+
+	if (nargs == 2) {
+		if (swap_setpolicy(args[1])) {
+			kprintf("repl: no policy %s\n", args[1]);
+			return EINVAL;
+		}
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: repl [policy]\n");
+		return EINVAL;
+	}
+	kprintf("Replacement policy: %s (of", swap_curpolicy());
+	for (i = 0; (name = swap_policyname(i)) != NULL; i++) {
+		kprintf(" %s", name);
+	}
+	kprintf(")\n");
+
+	return 0;
+}
+
+/*
+ * Page replacement benchmark: run the VM test programs, or the one
+ * given, once under each replacement policy and report the faults,
+ * swap traffic and time each policy needed. Nothing is reset between
+ * runs, so compare the policies against each other on a freshly
+ * booted kernel rather than reading much into the absolute numbers.
+ */
+static const char *replbench_progs[] = {
+	"/uw-testbin/vm-data1",
+	"/uw-testbin/vm-data2",
+	"/uw-testbin/vm-data3",
+	"/uw-testbin/vm-funcs",
+	"/uw-testbin/vm-stack1",
+	"/uw-testbin/vm-stack2",
+	"/uw-testbin/vm-mix1",
+	"/uw-testbin/vm-mix1-exec",
+	"/uw-testbin/vm-mix1-fork",
+	"/uw-testbin/vm-mix2",
+	"/testbin/parallelvm",
+	NULL
+};
+
+static
+void
+replbench_run(int nargs, char **args)
+{
+	/* Programs started from the menu run one at a time */
+	if (common_prog(nargs, args) == 0) {
+		P(sem_runproc);
+		V(sem_runproc);
+	}
+}
+
+static
+int
+cmd_replbench(int nargs, char **args)
+{
+	struct vmstats before, after;
+	struct timespec start, end, duration;
+	const char *orig, *name;
+	char prog[PATH_MAX];
+	char *progargs[1];
+	unsigned evicted, i, j;
+
+	orig = swap_curpolicy();
+	for (i = 0; (name = swap_policyname(i)) != NULL; i++) {
+		swap_setpolicy(name);
+		kprintf("replbench: %s\n", name);
+
+		vm_getstats(&before);
+		evicted = swap_evictions();
+		gettime(&start);
+		if (nargs > 1) {
+			replbench_run(nargs - 1, args + 1);
+		}
+		else {
+			for (j = 0; replbench_progs[j] != NULL; j++) {
+				strcpy(prog, replbench_progs[j]);
+				progargs[0] = prog;
+				replbench_run(1, progargs);
+			}
+		}
+		gettime(&end);
+		timespec_sub(&end, &start, &duration);
+		vm_getstats(&after);
+
+		kprintf("replbench: %s: %u faults, %u swap-ins, "
+			"%u evictions, %llu.%09lu seconds\n", name,
+			after.vs_faults - before.vs_faults,
+			after.vs_swapins - before.vs_swapins,
+			swap_evictions() - evicted,
+			(unsigned long long) duration.tv_sec,
+			(unsigned long) duration.tv_nsec);
+	}
+	swap_setpolicy(orig);
+
+	return 0;
+}
+
+/*
+ * Set how far the stacks of processes started from now on may grow.
+ */
+static
+int
+cmd_stacklimit(int nargs, char **args)
+{
+	unsigned pages;
+
+	if (nargs != 2) {
+		kprintf("Usage: stack pages\n");
+		return EINVAL;
+	}
+	pages = atoi(args[1]);
+	if (pages == 0 || pages > VM_STACKPAGES_MAX) {
+		kprintf("stack: limit must be 1 to %u pages\n",
+			VM_STACKPAGES_MAX);
+		return EINVAL;
+	}
+	vm_stackpages = pages;
+
+	return 0;
+}
+
 static
 int
 cmd_kheapgeneration(int nargs, char **args)
@@ -404,6 +649,35 @@ cmd_kheapdump(int nargs, char **args)
 	return 0;
 }
 
+/*
+ * The kmalloc profiler: with no argument, show the top call sites.
+ */
+static
+int
+cmd_kheapprof(int nargs, char **args)
+{
+	if (nargs == 1) {
+		kheap_profprint(20);
+	}
+	else if (nargs == 2 && !strcmp(args[1], "on")) {
+		kheap_profile(true);
+	}
+	else if (nargs == 2 && !strcmp(args[1], "off")) {
+		kheap_profile(false);
+	}
+	else if (nargs == 2 && !strcmp(args[1], "reset")) {
+		kheap_profreset();
+	}
+	else if (nargs == 2 && atoi(args[1]) > 0) {
+		kheap_profprint(atoi(args[1]));
+	}
+	else {
+		kprintf("Usage: khprof [on | off | reset | count]\n");
+	}
+
+	return 0;
+}
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -467,6 +741,7 @@ static const char *testmenu[] = {
 	"[km2] kmalloc stress test           ",
 	"[km3] Large kmalloc test            ",
 	"[km4] Multipage kmalloc test        ",
+	"[km5] Page allocator benchmark      ",
 	"[tt1] Thread test 1                 ",
 	"[tt2] Thread test 2                 ",
 	"[tt3] Thread test 3                 ",
@@ -511,6 +786,15 @@ static const char *mainmenu[] = {
 	"[kh] Kernel heap stats              ",
 	"[khgen] Next kernel heap generation ",
 	"[khdump] Dump kernel heap           ",
+	"[khprof] Kernel heap profiler       ",
+	"[kmc] Kernel object cache stats     ",
+	"[vmstat] VM fault and TLB counters  ",
+	"[frag] Free memory fragmentation    ",
+	"[fa] Set TLB fault-around window    ",
+	"[stack] Set user stack size limit   ",
+	"[po] Pageout watermarks and stats   ",
+	"[repl] Page replacement policy      ",
+	"[replbench] Compare repl. policies  ",
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -566,6 +850,15 @@ static struct {
 	{ "kh",         cmd_kheapstats },
 	{ "khgen",      cmd_kheapgeneration },
 	{ "khdump",     cmd_kheapdump },
+	{ "khprof",     cmd_kheapprof },
+	{ "kmc",        cmd_kmemcaches },
+	{ "vmstat",     cmd_vmstat },
+	{ "frag",       cmd_frag },
+	{ "fa",         cmd_faultaround },
+	{ "stack",      cmd_stacklimit },
+	{ "po",         cmd_pageout },
+	{ "repl",       cmd_replpolicy },
+	{ "replbench",  cmd_replbench },
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -575,6 +868,7 @@ static struct {
 	{ "km2",	kmallocstress },
 	{ "km3",	kmalloctest3 },
 	{ "km4",	kmalloctest4 },
+	{ "km5",	kmallocbench },
 #if OPT_NET
 	{ "net",	nettest },
 #endif
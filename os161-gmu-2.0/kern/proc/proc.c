@@ -53,6 +53,8 @@
 #include <proctable.h>
 #include <synch.h>
 #include <vm.h>
+#include <kmemcache.h>
+#include <mips/trapframe.h>
 
 /*
  * The process for the kernel; this holds all the kernel-only threads.
@@ -68,6 +70,47 @@ struct semaphore *sem_exec;
 struct semaphore *sem_runproc;
 struct semaphore *sem_proc;
 
+/*
+ * Object caches for the things every fork makes and every exit
+ * throws away. Cached procs keep their thread array (with its
+ * storage) and p_lock initialized.
+ */
+static struct kmem_cache *proc_cache;
+struct kmem_cache *pidlist_cache;
+struct kmem_cache *trapframe_cache;
+
+static
+int
+proc_ctor(void *obj)
+{
+	struct proc *proc = obj;
+
+	threadarray_init(&proc->p_threads);
+	spinlock_init(&proc->p_lock);
+	return 0;
+}
+
+static
+void
+proc_dtor(void *obj)
+{
+	struct proc *proc = obj;
+
+	threadarray_cleanup(&proc->p_threads);
+	spinlock_cleanup(&proc->p_lock);
+}
+
+/*
+ * Give back a proc structure from proc_create once it's torn down.
+ */
+static
+void
+proc_free(struct proc *proc)
+{
+	kfree(proc->p_name);
+	kmem_cache_free(proc_cache, proc);
+}
+
 /*
  * Create a proc structure.
  */
@@ -79,22 +122,19 @@ proc_create(const char *name)
 		P(sem_proc);
 	struct proc *proc;
 
-	proc = kmalloc(sizeof(*proc));
+	proc = kmem_cache_alloc(proc_cache);
 	if (proc == NULL) {
 		V(sem_proc);
 		return NULL;
 	}
 	proc->p_name = kstrdup(name);
 	if (proc->p_name == NULL) {
-		kfree(proc);
+		kmem_cache_free(proc_cache, proc);
 		proc = NULL;
 		V(sem_proc);
 		return NULL;
 	}
 
-	threadarray_init(&proc->p_threads);
-	spinlock_init(&proc->p_lock);
-
 	/* VM fields */
 	proc->p_addrspace = NULL;
 
@@ -215,11 +255,10 @@ proc_destroy(struct proc *proc)
 	for(i = 0; i < x - 1; i++) {
 		threadarray_remove(&proc->p_threads, 0);
 	}	
-	threadarray_cleanup(&proc->p_threads);
-	spinlock_cleanup(&proc->p_lock);
-	
-	kfree(proc->p_name);
-	kfree(proc);
+	/* the thread array and p_lock stay set up for the next proc */
+	KASSERT(threadarray_num(&proc->p_threads) == 0);
+
+	proc_free(proc);
 	V(sem_proc);
 }
 
@@ -230,6 +269,18 @@ void
 proc_bootstrap(void)
 {
 	vm_bootstrap();
+
+	proc_cache = kmem_cache_create("proc", sizeof(struct proc),
+				       proc_ctor, proc_dtor);
+	pidlist_cache = kmem_cache_create("pid_list",
+					  sizeof(struct pid_list), NULL, NULL);
+	trapframe_cache = kmem_cache_create("trapframe",
+					    sizeof(struct trapframe),
+					    NULL, NULL);
+	if (proc_cache == NULL || pidlist_cache == NULL ||
+	    trapframe_cache == NULL) {
+		panic("Cannot create process object caches\n");
+	}
 	// create the processes table
 	process_table = array_create();
 	if(process_table == NULL)
@@ -305,7 +356,7 @@ proc_create_runprogram(const char *name)
 	lock_acquire(getpid_lock);
 	pid_t pid = get_pid();
 	if(pid == -1) {	// no more pids
-		kfree(newproc);
+		proc_free(newproc);
 		lock_release(getpid_lock);
 		V(sem_runproc);
 		return NULL;
@@ -316,7 +367,7 @@ proc_create_runprogram(const char *name)
 	if(array_get(lock_table, pid) == NULL) {
                 l = lock_create("lock");
                 if(l == NULL) {
-			kfree(newproc);
+			proc_free(newproc);
 			lock_release(getpid_lock);
 			V(sem_runproc);
 			return NULL;
@@ -327,7 +378,7 @@ proc_create_runprogram(const char *name)
         if(array_get(cv_table, pid) == NULL) {
                 c = cv_create("cv");
                 if(c == NULL) {
-                        kfree(newproc);
+                        proc_free(newproc);
 			lock_destroy(array_get(lock_table, pid));
 			array_set(lock_table, pid, NULL);
 			lock_release(getpid_lock);
@@ -339,9 +390,9 @@ proc_create_runprogram(const char *name)
 
 	// add child pid to head of list of parent's children
 	struct pid_list *parents_child;
-        parents_child = kmalloc(sizeof(*parents_child));
+        parents_child = kmem_cache_alloc(pidlist_cache);
         if(parents_child == NULL) {
-                kfree(newproc);
+                proc_free(newproc);
 		lock_destroy(array_get(lock_table, pid));
 		array_set(lock_table, pid, NULL);
 		lock_destroy(array_get(cv_table, pid));
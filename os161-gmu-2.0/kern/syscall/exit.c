@@ -6,6 +6,7 @@
 #include <spl.h>
 #include <kern/wait.h>
 #include <addrspace.h>
+#include <kmemcache.h>
 
 void sys__exit(int exitcode) {
 		
@@ -44,7 +45,7 @@ void sys__exit(int exitcode) {
         while(curproc->children != NULL) {
 		tofree = curproc->children;
                 curproc->children = curproc->children->next;  
-                kfree(tofree);
+                kmem_cache_free(pidlist_cache, tofree);
 		tofree = NULL;
         }                                                                 
 	lock_release(getpid_lock);
@@ -55,6 +56,11 @@ void sys__exit(int exitcode) {
 	int run = p->runtype;
 	as_deactivate();
 	as = proc_setas(NULL); 
+#if !OPT_DUMBVM
+	if(vm_fareport && as != NULL)
+		kprintf("%s: %u tlb faults, %u entries preloaded\n",
+			p->p_name, as->as_tlbfaults, as->as_tlbpreloads);
+#endif
 	as_destroy(as);
 	if(run)
 		V(sem_runproc);
@@ -9,12 +9,14 @@
 #include <kern/errno.h>
 #include <mips/trapframe.h>
 #include <addrspace.h>
+#include <kmemcache.h>
 
 static void init_child_proc(void *p, unsigned long data) {
 
 	(void) data;
 	struct trapframe tf;
 	tf = *(struct trapframe *)p;
+	kmem_cache_free(trapframe_cache, p);
 	// activate child's addr space
 	as_activate();
 
@@ -91,7 +93,7 @@ pid_t sys_fork(struct trapframe *tf, int *err) {
 
 	// add child pid to head of list of parent's children
 	struct pid_list *parents_child; 
-	parents_child = kmalloc(sizeof(*parents_child));
+	parents_child = kmem_cache_alloc(pidlist_cache);
 	if(parents_child == NULL) {
 		*err = ENOMEM;
 		goto err2;
@@ -118,17 +120,24 @@ pid_t sys_fork(struct trapframe *tf, int *err) {
 	// trapframe struct does not contain any pointers
 	// so this should make an exact deep copy
 	//struct trapframe child_tf = *tf;
-	struct trapframe *child_tf = (struct trapframe *)kmalloc(sizeof(struct trapframe));
+	// the child frees it once it has its own copy on its stack
+	struct trapframe *child_tf = kmem_cache_alloc(trapframe_cache);
+	if(child_tf == NULL) {
+		*err = ENOMEM;
+		goto err3;
+	}
 	*child_tf = *tf;
 	
 	// create thread for newly created proc
 	result = thread_fork("thread", child, init_child_proc, child_tf, 0);
 
 	if(result == ENOMEM) {
+		kmem_cache_free(trapframe_cache, child_tf);
 		lock_release(child->lock);
 		*err = ENOMEM;
 		goto err3;
 	} else if (result) {
+		kmem_cache_free(trapframe_cache, child_tf);
 		lock_release(child->lock);
 		*err = result;
 		goto err3;
@@ -141,7 +150,7 @@ pid_t sys_fork(struct trapframe *tf, int *err) {
 	err3:
 		parents_child = curproc->children;
 		curproc->children = curproc->children->next;
-		kfree(parents_child);
+		kmem_cache_free(pidlist_cache, parents_child);
 		parents_child = NULL;
 	err2:
 		proc_destroy(child);
@@ -34,7 +34,9 @@
  * It makes the following address space calls:
  *    - first, as_define_region once for each segment of the program;
  *    - then, as_prepare_load;
- *    - then it loads each chunk of the program;
+ *    - then it loads each chunk of the program (or, without dumbvm,
+ *      tells the address space where in the file each segment comes
+ *      from with as_define_file, so pages are read on first touch);
  *    - finally, as_complete_load.
  *
  * This gives the VM code enough flexibility to deal with even grossly
@@ -60,6 +62,8 @@
 #include <vnode.h>
 #include <elf.h>
 
+#if OPT_DUMBVM
+
 /*
  * Load a segment at virtual address VADDR. The segment in memory
  * extends from VADDR up to (but not including) VADDR+MEMSIZE. The
@@ -144,6 +148,7 @@ load_segment(struct addrspace *as, struct vnode *v,
 
 	return result;
 }
+#endif /* OPT_DUMBVM */
 
 /*
  * Load an ELF executable user program into the current address space.
@@ -288,9 +293,14 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 			return ENOEXEC;
 		}
 
+#if OPT_DUMBVM
 		result = load_segment(as, v, ph.p_offset, ph.p_vaddr,
 				      ph.p_memsz, ph.p_filesz,
 				      ph.p_flags & PF_X);
+#else
+		result = as_define_file(as, v, ph.p_offset, ph.p_vaddr,
+					ph.p_memsz, ph.p_filesz);
+#endif
 		if (result) {
 			return result;
 		}
@@ -0,0 +1,135 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/mman.h>
+#include <lib.h>
+#include <proc.h>
+#include <current.h>
+#include <vnode.h>
+#include <openfile.h>
+#include <filetable.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <pagecache.h>
+#include <syscall.h>
+
+/*
+ * mmap() - map part of an open file. The address hint is ignored and
+ * MAP_FIXED isn't supported; the kernel picks a free spot below the
+ * stack. Nothing is read here: pages come in through the file's page
+ * cache as they're touched.
+ */
+int
+sys_mmap(userptr_t addr, size_t len, int prot, int flags, int fd,
+	 off_t offset, int *retval)
+{
+	struct openfile *file;
+	struct pagecache *pc;
+	struct addrspace *as;
+	size_t npages;
+	vaddr_t vaddr;
+	int result;
+
+	(void)addr;
+
+	if (len == 0 || offset < 0 || offset % PAGE_SIZE != 0) {
+		return EINVAL;
+	}
+	if (flags != MAP_SHARED && flags != MAP_PRIVATE) {
+		return EINVAL;
+	}
+	npages = DIVROUNDUP(len, PAGE_SIZE);
+	if (npages > USERSPACETOP / PAGE_SIZE ||
+	    offset / PAGE_SIZE + npages > USERSPACETOP / PAGE_SIZE) {
+		return ENOMEM;
+	}
+
+	result = filetable_get(curproc->p_filetable, fd, &file);
+	if (result) {
+		return result;
+	}
+
+	/* Need to be able to read it, and to write it if writes get back */
+	if (file->of_accmode == O_WRONLY ||
+	    (flags == MAP_SHARED && (prot & PROT_WRITE) &&
+	     file->of_accmode != O_RDWR)) {
+		filetable_put(curproc->p_filetable, fd, file);
+		return EACCES;
+	}
+
+	result = VOP_MMAP(file->of_vnode, prot);
+	if (result == 0) {
+		result = pagecache_get(file->of_vnode, &pc);
+	}
+	filetable_put(curproc->p_filetable, fd, file);
+	if (result) {
+		return result;
+	}
+
+	as = proc_getas();
+	result = as_mmap(as, npages, (prot & PROT_WRITE) != 0,
+			 flags == MAP_SHARED, pc, offset / PAGE_SIZE, &vaddr);
+	if (result) {
+		pagecache_release(pc);
+		return result;
+	}
+
+	*retval = (int)vaddr;
+	return 0;
+}
+
+/*
+ * Check that [ADDR, ADDR+LEN) is a page-aligned range of user space
+ * and return it in pages.
+ */
+static
+int
+mmap_range(userptr_t addr, size_t len, vaddr_t *vaddr, size_t *npages)
+{
+	*vaddr = (vaddr_t)addr;
+	if (len == 0 || *vaddr % PAGE_SIZE != 0 || *vaddr >= USERSPACETOP ||
+	    len > USERSPACETOP - *vaddr) {
+		return EINVAL;
+	}
+	*npages = DIVROUNDUP(len, PAGE_SIZE);
+	return 0;
+}
+
+/*
+ * munmap() - remove mappings in a range, writing back dirty shared
+ * pages. Parts of the range not mapped from a file are left alone.
+ */
+int
+sys_munmap(userptr_t addr, size_t len)
+{
+	vaddr_t vaddr;
+	size_t npages;
+	int result;
+
+	result = mmap_range(addr, len, &vaddr, &npages);
+	if (result) {
+		return result;
+	}
+	return as_munmap(proc_getas(), vaddr, npages);
+}
+
+/*
+ * msync() - write back dirty shared pages in a range. The writeback
+ * is always done before returning, whichever flag is given.
+ */
+int
+sys_msync(userptr_t addr, size_t len, int flags)
+{
+	vaddr_t vaddr;
+	size_t npages;
+	int result;
+
+	if (flags != MS_SYNC && flags != MS_ASYNC) {
+		return EINVAL;
+	}
+	result = mmap_range(addr, len, &vaddr, &npages);
+	if (result) {
+		return result;
+	}
+	return as_msync(proc_getas(), vaddr, npages);
+}
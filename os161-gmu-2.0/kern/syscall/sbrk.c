@@ -0,0 +1,51 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <proc.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <pagetable.h>
+#include <syscall.h>
+
+/*
+ * Move the break AMOUNT bytes and return the old one. Nothing is
+ * allocated here: heap pages get a frame in vm_fault the first time
+ * they're touched. Pages wholly above a lowered break are unmapped
+ * and their frames and swap slots given back straight away. The heap
+ * may grow up to the lowest mapped file, or the stack if there is
+ * none.
+ */
+int
+sys_sbrk(intptr_t amount, int *retval)
+{
+	struct addrspace *as;
+	vaddr_t oldtop, newtop, oldend, newend;
+
+	as = proc_getas();
+	KASSERT(as != NULL);
+	KASSERT(as->as_heap != NULL);
+
+	oldtop = as->as_heaptop;
+	newtop = oldtop + amount;
+
+	if (amount < 0) {
+		if (0 - (vaddr_t)amount > oldtop - as->as_heap->vr_base) {
+			return EINVAL;
+		}
+	}
+	else if (newtop < oldtop || newtop > as_heaplimit(as)) {
+		return ENOMEM;
+	}
+
+	oldend = ROUNDUP(oldtop, PAGE_SIZE);
+	newend = ROUNDUP(newtop, PAGE_SIZE);
+	if (newend < oldend) {
+		pagetable_unmap(as->as_pt, newend,
+				(oldend - newend) / PAGE_SIZE);
+	}
+
+	as->as_heaptop = newtop;
+	as->as_heap->vr_top = newend;
+	*retval = (int)oldtop;
+	return 0;
+}
@@ -35,6 +35,7 @@
 #include <lib.h>
 #include <thread.h>
 #include <synch.h>
+#include <clock.h>
 #include <vm.h> /* for PAGE_SIZE */
 #include <test.h>
 
@@ -378,3 +379,76 @@ kmalloctest4(int nargs, char **args)
 	kprintf("Multipage kmalloc test done\n");
 	return 0;
 }
+
+////////////////////////////////////////////////////////////
+// km5
+
+/*
+ * Page allocator throughput. For each block size, repeatedly
+ * allocate a batch of blocks and free them again, odd ones first so
+ * that frees don't simply undo the allocations in order. Reports the
+ * average time for one alloc/free pair.
+ *
+ * Run this on an otherwise idle system; the numbers are only useful
+ * for comparing allocator changes against each other.
+ */
+
+#define KM5_ROUNDS  200
+#define KM5_BATCH   16
+
+static const unsigned km5_pages[] = { 1, 2, 3, 4, 8 };
+#define NUM_KM5_SIZES (sizeof(km5_pages) / sizeof(km5_pages[0]))
+
+int
+kmallocbench(int nargs, char **args)
+{
+	void *ptrs[KM5_BATCH];
+	struct timespec before, after, duration;
+	uint64_t ns;
+	unsigned i, j, k, n;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting page allocator benchmark...\n");
+#if OPT_DUMBVM
+	kprintf("(This test will not work with dumbvm)\n");
+#endif
+
+	for (i=0; i<NUM_KM5_SIZES; i++) {
+		n = 0;
+		gettime(&before);
+		for (j=0; j<KM5_ROUNDS; j++) {
+			for (k=0; k<KM5_BATCH; k++) {
+				ptrs[k] = kmalloc(km5_pages[i] * PAGE_SIZE);
+				if (ptrs[k] != NULL) {
+					n++;
+				}
+			}
+			for (k=1; k<KM5_BATCH; k+=2) {
+				kfree(ptrs[k]);
+			}
+			for (k=0; k<KM5_BATCH; k+=2) {
+				kfree(ptrs[k]);
+			}
+		}
+		gettime(&after);
+		timespec_sub(&after, &before, &duration);
+
+		if (n == 0) {
+			kprintf("km5: %u-page blocks: all allocations failed\n",
+				km5_pages[i]);
+			continue;
+		}
+		ns = duration.tv_sec * (uint64_t)1000000000 + duration.tv_nsec;
+		kprintf("km5: %u-page blocks: %u pairs, %llu ns each\n",
+			km5_pages[i], n, (unsigned long long)(ns / n));
+		if (n < KM5_ROUNDS * KM5_BATCH) {
+			kprintf("km5: (%u allocations failed)\n",
+				KM5_ROUNDS * KM5_BATCH - n);
+		}
+	}
+
+	kprintf("Page allocator benchmark done\n");
+	return 0;
+}
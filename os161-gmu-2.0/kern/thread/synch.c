@@ -164,6 +164,8 @@ lock_create(const char *name)
 		return NULL;
 	}
 	spinlock_init(&lock->lock_spinlock);
+	lock->flag = 0;
+	lock->holder = NULL;
 
 	return lock;
 }
@@ -38,6 +38,7 @@
 #include <lib.h>
 #include <array.h>
 #include <cpu.h>
+#include <platform/maxcpus.h>
 #include <spl.h>
 #include <spinlock.h>
 #include <wchan.h>
@@ -48,8 +49,10 @@
 #include <current.h>
 #include <synch.h>
 #include <addrspace.h>
+#include <vm.h>
 #include <mainbus.h>
 #include <vnode.h>
+#include <kmemcache.h>
 
 #include "opt-synchprobs.h"
 
@@ -64,6 +67,13 @@ struct wchan {
 	unsigned wc_index;		/* index into allwchans[] */
 };
 
+/*
+ * Caches of thread structures and stacks, so forking a thread doesn't
+ * have to find a fresh page for its stack every time.
+ */
+static struct kmem_cache *thread_cache;
+static struct kmem_cache *thread_stackcache;
+
 /* Master array of CPUs. */
 DECLARRAY(cpu, static __UNUSED inline);
 DEFARRAY(cpu, static __UNUSED inline);
@@ -129,14 +139,14 @@ thread_create(const char *name)
 
 	DEBUGASSERT(name != NULL);
 
-	thread = kmalloc(sizeof(*thread));
+	thread = kmem_cache_alloc(thread_cache);
 	if (thread == NULL) {
 		return NULL;
 	}
 
 	thread->t_name = kstrdup(name);
 	if (thread->t_name == NULL) {
-		kfree(thread);
+		kmem_cache_free(thread_cache, thread);
 		return NULL;
 	}
 	thread->t_wchan_name = "NEW";
@@ -194,6 +204,12 @@ cpu_create(unsigned hardware_number)
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
+	c->c_shootdown_ticket = 0;
+	c->c_shootdown_done = 0;
+	c->c_shootdown_wchan = wchan_create("shootdown");
+	if (c->c_shootdown_wchan == NULL) {
+		panic("cpu_create: Out of memory\n");
+	}
 	spinlock_init(&c->c_ipi_lock);
 
 	result = cpuarray_add(&allcpus, c, &c->c_number);
@@ -221,7 +237,7 @@ cpu_create(unsigned hardware_number)
 		/*c->c_curthread->t_stack = ... */
 	}
 	else {
-		c->c_curthread->t_stack = kmalloc(STACK_SIZE);
+		c->c_curthread->t_stack = kmem_cache_alloc(thread_stackcache);
 		if (c->c_curthread->t_stack == NULL) {
 			panic("cpu_create: couldn't allocate stack");
 		}
@@ -257,7 +273,7 @@ thread_destroy(struct thread *thread)
 	/* Thread subsystem fields */
 	KASSERT(thread->t_proc == NULL);
 	if (thread->t_stack != NULL) {
-		kfree(thread->t_stack);
+		kmem_cache_free(thread_stackcache, thread->t_stack);
 	}
 	threadlistnode_cleanup(&thread->t_listnode);
 	thread_machdep_cleanup(&thread->t_machdep);
@@ -266,7 +282,7 @@ thread_destroy(struct thread *thread)
 	thread->t_wchan_name = "DESTROYED";
 
 	kfree(thread->t_name);
-	kfree(thread);
+	kmem_cache_free(thread_cache, thread);
 }
 
 /*
@@ -358,6 +374,14 @@ thread_bootstrap(void)
 
 	cpuarray_init(&allcpus);
 
+	thread_cache = kmem_cache_create("thread", sizeof(struct thread),
+					 NULL, NULL);
+	thread_stackcache = kmem_cache_create("stack", STACK_SIZE,
+					      NULL, NULL);
+	if (thread_cache == NULL || thread_stackcache == NULL) {
+		panic("thread_bootstrap: Out of memory\n");
+	}
+
 	/*
 	 * Create the cpu structure for the bootup CPU, the one we're
 	 * currently running on. Assume the hardware number is 0; that
@@ -509,7 +533,7 @@ thread_fork(const char *name,
 	}
 
 	/* Allocate a stack */
-	newthread->t_stack = kmalloc(STACK_SIZE);
+	newthread->t_stack = kmem_cache_alloc(thread_stackcache);
 	if (newthread->t_stack == NULL) {
 		thread_destroy(newthread);
 		return ENOMEM;
@@ -639,6 +663,12 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	 * Note that c_isidle becomes true briefly even if we don't go
 	 * idle. However, because one is supposed to hold the runqueue
 	 * lock to look at it, this should not be visible or matter.
+	 *
+	 * Before actually idling, put the time to use zeroing free
+	 * pages for the VM system, one page per trip around the loop.
+	 * Interrupts are let in briefly after each page, the same way
+	 * cpu_idle does, so a wakeup is noticed and acted on as soon
+	 * as that page is done.
 	 */
 
 	/* The current cpu is now idle. */
@@ -647,7 +677,12 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 		next = threadlist_remhead(&curcpu->c_runqueue);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			if (vm_idlezero()) {
+				cpu_irqonoff();
+			}
+			else {
+				cpu_idle();
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
@@ -1185,28 +1220,108 @@ ipi_broadcast(int code)
 	}
 }
 
-void
-ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
+/*
+ * Queue N shootdowns on TARGET and send it one IPI for the lot. If
+ * its queue overflows it flushes everything instead. Returns the
+ * batch's ticket. Call with the target's IPI lock held.
+ */
+static
+unsigned
+ipi_tlbshootdown_queue(struct cpu *target,
+		       const struct tlbshootdown *mappings, unsigned n)
 {
-	int n;
+	unsigned i;
+	int k;
 
-	spinlock_acquire(&target->c_ipi_lock);
+	KASSERT(spinlock_do_i_hold(&target->c_ipi_lock));
 
-	n = target->c_numshootdown;
-	if (n == TLBSHOOTDOWN_MAX) {
-		target->c_numshootdown = TLBSHOOTDOWN_ALL;
-	}
-	else {
-		target->c_shootdown[n] = *mapping;
-		target->c_numshootdown = n+1;
+	for (i=0; i<n; i++) {
+		k = target->c_numshootdown;
+		if (k == TLBSHOOTDOWN_ALL) {
+			break;
+		}
+		if (k == TLBSHOOTDOWN_MAX) {
+			target->c_numshootdown = TLBSHOOTDOWN_ALL;
+			break;
+		}
+		target->c_shootdown[k] = mappings[i];
+		target->c_numshootdown = k+1;
 	}
 
 	target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
 	mainbus_send_ipi(target);
 
+	return ++target->c_shootdown_ticket;
+}
+
+void
+ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
+{
+	spinlock_acquire(&target->c_ipi_lock);
+	ipi_tlbshootdown_queue(target, mapping, 1);
 	spinlock_release(&target->c_ipi_lock);
 }
 
+void
+ipi_tlbshootdown_sync(uint32_t cpumask,
+		      const struct tlbshootdown *mappings, unsigned n)
+{
+	unsigned tickets[MAXCPUS];
+	bool sent[MAXCPUS];
+	unsigned i, k, num;
+	struct cpu *c;
+	int spl;
+
+	KASSERT(!curthread->t_in_interrupt);
+	KASSERT(curcpu->c_spinlocks == 0);
+
+	num = cpuarray_num(&allcpus);
+
+	/*
+	 * Send everything first so the other cpus work in parallel. We
+	 * stay on one cpu while doing it; if that cpu is in the mask
+	 * (we may have moved since the caller worked the mask out) it
+	 * does its share here, as the interrupt handler would.
+	 */
+	spl = splhigh();
+	for (i=0; i<num; i++) {
+		c = cpuarray_get(&allcpus, i);
+		sent[i] = false;
+		if ((cpumask & (1U << c->c_number)) == 0) {
+			continue;
+		}
+		if (c == curcpu->c_self) {
+			if (n > TLBSHOOTDOWN_MAX) {
+				vm_tlbshootdown_all();
+			}
+			else {
+				for (k=0; k<n; k++) {
+					vm_tlbshootdown(&mappings[k]);
+				}
+			}
+			continue;
+		}
+		spinlock_acquire(&c->c_ipi_lock);
+		tickets[i] = ipi_tlbshootdown_queue(c, mappings, n);
+		spinlock_release(&c->c_ipi_lock);
+		sent[i] = true;
+	}
+	splx(spl);
+
+	/* Then sleep until each one we sent to has caught up */
+	for (i=0; i<num; i++) {
+		if (!sent[i]) {
+			continue;
+		}
+		c = cpuarray_get(&allcpus, i);
+		spinlock_acquire(&c->c_ipi_lock);
+		while ((int)(c->c_shootdown_done - tickets[i]) < 0) {
+			wchan_sleep(c->c_shootdown_wchan, &c->c_ipi_lock);
+		}
+		spinlock_release(&c->c_ipi_lock);
+	}
+}
+
 void
 interprocessor_interrupt(void)
 {
@@ -1249,6 +1364,8 @@ interprocessor_interrupt(void)
 			}
 		}
 		curcpu->c_numshootdown = 0;
+		curcpu->c_shootdown_done = curcpu->c_shootdown_ticket;
+		wchan_wakeall(curcpu->c_shootdown_wchan, &curcpu->c_ipi_lock);
 	}
 
 	curcpu->c_ipi_pending = 0;
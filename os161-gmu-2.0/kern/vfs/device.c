@@ -237,15 +237,15 @@ null_fsync(struct vnode *v)
 }
 
 /*
- * For mmap. If you want this to do anything, you have to write it
- * yourself. Some devices may not make sense to map. Others do.
+ * For mmap. No device supports being mapped.
  */
 static
 int
-dev_mmap(struct vnode *v  /* add stuff as needed */)
+dev_mmap(struct vnode *v, int prot)
 {
 	(void)v;
-	return ENOSYS;
+	(void)prot;
+	return ENODEV;
 }
 
 /*
@@ -29,9 +29,15 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/stat.h>
 #include <lib.h>
+#include <uio.h>
+#include <vnode.h>
+#define ADDRSPACEINLINE
 #include <addrspace.h>
 #include <vm.h>
+#include <pagetable.h>
+#include <pagecache.h>
 #include <proc.h>
 #include <spl.h>
 #include <mips/tlb.h>
@@ -42,6 +48,138 @@
  * used. The cheesy hack versions in dumbvm.c are used instead.
  */
 
+/* Stack size limit for new address spaces, in pages; see vm.h */
+unsigned vm_stackpages = VM_STACKPAGES_DEFAULT;
+
+/*
+ * Regions are kept in an array sorted by address, so finding the one
+ * holding an address is a binary search. Since faults tend to come in
+ * runs in the same region, the last region found is checked first.
+ * Anything that adds or removes regions clears as_lastregion.
+ */
+
+/*
+ * The index of the first region ending above VADDR: the one holding
+ * VADDR if there is one, else the next one up (or the number of
+ * regions if there's none).
+ */
+static
+unsigned
+as_regionindex(struct addrspace *as, vaddr_t vaddr)
+{
+	unsigned lo, hi, mid;
+
+	lo = 0;
+	hi = vmregionarray_num(&as->as_regions);
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (vmregionarray_get(&as->as_regions, mid)->vr_top <= vaddr) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+struct vmregion *
+as_findregion(struct addrspace *as, vaddr_t vaddr)
+{
+	struct vmregion *vr;
+	unsigned i;
+
+	vr = as->as_lastregion;
+	if (vr != NULL && vaddr >= vr->vr_base && vaddr < vr->vr_top) {
+		return vr;
+	}
+	i = as_regionindex(as, vaddr);
+	if (i == vmregionarray_num(&as->as_regions)) {
+		return NULL;
+	}
+	vr = vmregionarray_get(&as->as_regions, i);
+	if (vaddr < vr->vr_base) {
+		return NULL;
+	}
+	as->as_lastregion = vr;
+	return vr;
+}
+
+/*
+ * Put VR in its place in the array. Fails with EINVAL if it overlaps
+ * another region.
+ */
+static
+int
+as_addregion(struct addrspace *as, struct vmregion *vr)
+{
+	struct vmregion *next;
+	unsigned i, j, num;
+	int result;
+
+	num = vmregionarray_num(&as->as_regions);
+	i = as_regionindex(as, vr->vr_base);
+	if (i < num) {
+		next = vmregionarray_get(&as->as_regions, i);
+		if (next->vr_base < vr->vr_top) {
+			return EINVAL;
+		}
+	}
+
+	result = vmregionarray_setsize(&as->as_regions, num + 1);
+	if (result) {
+		return result;
+	}
+	for (j = num; j > i; j--) {
+		vmregionarray_set(&as->as_regions, j,
+				  vmregionarray_get(&as->as_regions, j - 1));
+	}
+	vmregionarray_set(&as->as_regions, i, vr);
+	as->as_lastregion = NULL;
+	return 0;
+}
+
+static
+struct vmregion *
+as_newregion(vaddr_t base, vaddr_t top, int type, int writable)
+{
+	struct vmregion *vr;
+
+	vr = kmalloc(sizeof(*vr));
+	if (vr == NULL) {
+		return NULL;
+	}
+	vr->vr_base = base;
+	vr->vr_top = top;
+	vr->vr_type = type;
+	vr->vr_writable = writable;
+	vr->vr_filevaddr = base;
+	vr->vr_fileoff = 0;
+	vr->vr_filesz = 0;
+	vr->vr_pgoff = 0;
+	vr->vr_shared = 0;
+	vr->vr_pc = NULL;
+	return vr;
+}
+
+/*
+ * Let go of a region that's no longer in the array, writing back a
+ * shared mapping's dirty pages. The pages must be unmapped already.
+ */
+static
+void
+as_freeregion(struct vmregion *vr)
+{
+	if (vr->vr_pc != NULL) {
+		if (vr->vr_shared) {
+			(void)pagecache_sync(vr->vr_pc, vr->vr_pgoff,
+					     (vr->vr_top - vr->vr_base) /
+					     PAGE_SIZE);
+		}
+		pagecache_release(vr->vr_pc);
+	}
+	kfree(vr);
+}
 
 struct addrspace *
 as_create(void)
@@ -56,14 +194,24 @@ as_create(void)
 	/*
 	 * Initialize as needed.
 	 */
-	as->as_vbase1 = 0;
-	as->as_pbase1 = 0;
-	as->as_npages1 = 0;
-	as->as_vbase2 = 0;
-	as->as_pbase2 = 0;
-	as->as_npages2 = 0;
-	as->as_stackpbase = 0;
+	vmregionarray_init(&as->as_regions);
+	as->as_lastregion = NULL;
+	as->as_heap = NULL;
+	as->as_stack = NULL;
+	as->as_vn = NULL;
+	as->as_textpc = NULL;
+	as->as_heaptop = 0;
+	as->as_stacklimit = USERSTACK - vm_stackpages * PAGE_SIZE;
 	as->complete = 0;
+	as->as_tlbfaults = 0;
+	as->as_tlbpreloads = 0;
+
+	as->as_pt = pagetable_create();
+	if (as->as_pt == NULL) {
+		vmregionarray_cleanup(&as->as_regions);
+		kfree(as);
+		return NULL;
+	}
 
 	return as;
 }
@@ -72,6 +220,9 @@ int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
 	struct addrspace *newas;
+	struct vmregion *vr, *newvr;
+	unsigned i, num;
+	int result;
 
 	newas = as_create();
 	if (newas==NULL) {
@@ -82,35 +233,51 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 	 * Write this.
 	 */
 
-	newas->as_vbase1 = old->as_vbase1;
-	newas->writable1 = old->writable1;
-	newas->as_npages1 = old->as_npages1;
-	newas->as_vbase2 = old->as_vbase2;
-	newas->writable2 = old->writable2;
-	newas->as_npages2 = old->as_npages2;
+	// pages the parent never touched are still read from the file
+	newas->as_vn = old->as_vn;
+	if(newas->as_vn != NULL)
+		VOP_INCREF(newas->as_vn);
+	newas->as_textpc = old->as_textpc;
+	if(newas->as_textpc != NULL)
+		pagecache_incref(newas->as_textpc);
+	newas->as_heaptop = old->as_heaptop;
+	newas->as_stacklimit = old->as_stacklimit;
+
+	// the child maps the same files; its pages are shared below
+	num = vmregionarray_num(&old->as_regions);
+	result = vmregionarray_preallocate(&newas->as_regions, num);
+	if(result) {
+		as_destroy(newas);
+		return result;
+	}
+	for(i = 0; i < num; i++) {
+		vr = vmregionarray_get(&old->as_regions, i);
+		newvr = kmalloc(sizeof(*newvr));
+		if(newvr == NULL) {
+			as_destroy(newas);
+			return ENOMEM;
+		}
+		*newvr = *vr;
+		if(newvr->vr_pc != NULL)
+			pagecache_incref(newvr->vr_pc);
+		// preallocated, so this can't fail
+		result = vmregionarray_add(&newas->as_regions, newvr, NULL);
+		KASSERT(result == 0);
+		if(vr == old->as_heap)
+			newas->as_heap = newvr;
+		if(vr == old->as_stack)
+			newas->as_stack = newvr;
+	}
 
-	// Use as_prepare_load to find free pages for
-	// the new address space
-	if(as_prepare_load(newas)) {
+	// share the parent's resident pages; whichever side writes
+	// first gets its own copy in vm_fault
+	if(pagetable_copy(old->as_pt, newas->as_pt)) {
 		as_destroy(newas);
 		return ENOMEM;
 	}
-
-	KASSERT(newas->as_pbase1 != 0);
-	KASSERT(newas->as_pbase2 != 0);
-        KASSERT(newas->as_stackpbase != 0);
-
-	memmove((void *)PADDR_TO_KVADDR(newas->as_pbase1),
-                (const void *)PADDR_TO_KVADDR(old->as_pbase1),
-                old->as_npages1*PAGE_SIZE);
-
-	memmove((void *)PADDR_TO_KVADDR(newas->as_pbase2),
-		(const void *)PADDR_TO_KVADDR(old->as_pbase2),
-		old->as_npages2*PAGE_SIZE);
-
-        memmove((void *)PADDR_TO_KVADDR(newas->as_stackpbase),
-                (const void *)PADDR_TO_KVADDR(old->as_stackpbase),
-                VM_STACKPAGES*PAGE_SIZE);
+	// the parent may still hold writable TLB entries for pages
+	// that are now copy-on-write, on this or any other CPU
+	vm_tlbflush(old->as_pt);
 
 	newas->complete = 1;
 	*ret = newas;
@@ -124,17 +291,21 @@ as_destroy(struct addrspace *as)
 	 * Clean up as needed.
 	 */
 
+	unsigned i;
 
-	if(as->as_pbase1 != 0) {
-		free_kpages(PADDR_TO_KVADDR(as->as_pbase1));
-	}
-	if(as->as_pbase2 != 0) {
-		free_kpages(PADDR_TO_KVADDR(as->as_pbase2));
-	}
+	// frees every resident frame along with the tables
+	pagetable_destroy(as->as_pt);
 
-	if(as->as_stackpbase != 0) {
-		free_kpages(PADDR_TO_KVADDR(as->as_stackpbase));
-	}
+	// now that we no longer map them, write back what we dirtied
+	for(i = 0; i < vmregionarray_num(&as->as_regions); i++)
+		as_freeregion(vmregionarray_get(&as->as_regions, i));
+	vmregionarray_setsize(&as->as_regions, 0);
+	vmregionarray_cleanup(&as->as_regions);
+
+	if(as->as_textpc != NULL)
+		pagecache_release(as->as_textpc);
+	if(as->as_vn != NULL)
+		VOP_DECREF(as->as_vn);
 	kfree(as);
 }
 
@@ -153,16 +324,10 @@ as_activate(void)
 	}
 
 	/*
-	 * Write this.
+	 * TLB entries are tagged with the address space ID, so there
+	 * is nothing to flush; just switch to ours.
 	 */
-	int spl;
-	spl = splhigh();
-	int i;
-        for (i=0; i<NUM_TLB; i++) {
-                tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
-        }
-
-        splx(spl);
+	vm_activate(as->as_pt);
 }
 
 void
@@ -192,7 +357,8 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 	/*
 	 * Write this.
 	 */
-	size_t npages;
+	struct vmregion *vr;
+	int result;
 
 	/* Align the region. First, the base... */
         sz += vaddr & ~(vaddr_t)PAGE_FRAME;
@@ -201,92 +367,406 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 	/* ...and now the length. */
         sz = (sz + PAGE_SIZE - 1) & PAGE_FRAME;
 
-        npages = sz / PAGE_SIZE;
+	// uiomove used to catch this when segments were loaded eagerly.
+	// The stack's reservation and its guard page are off limits too.
+	if (vaddr + sz > as->as_stacklimit - PAGE_SIZE || vaddr + sz < vaddr) {
+		return EFAULT;
+	}
 
 	(void)readable;
 	(void)executable;
 
-	if (as->as_vbase1 == 0) {
-                as->as_vbase1 = vaddr;
-		as->writable1 = writable;
-                as->as_npages1 = npages;
-                return 0;
-        }
-
-	if (as->as_vbase2 == 0) {
-		as->as_vbase2 = vaddr;
-		as->writable2 = writable;
-		as->as_npages2 = npages;
-		return 0;
+	vr = as_newregion(vaddr, vaddr + sz, VR_SEGMENT, writable);
+	if (vr == NULL) {
+		return ENOMEM;
 	}
-
-	//return EUNIMP;
-	return -1;
+	result = as_addregion(as, vr);
+	if (result) {
+		kfree(vr);
+		return result;
+	}
+	return 0;
 }
 
-static
-void
-as_zero_region(paddr_t paddr, unsigned npages)
+int
+as_prepare_load(struct addrspace *as)
 {
-        bzero((void *)PADDR_TO_KVADDR(paddr), npages * PAGE_SIZE);
+	/*
+	 * Nothing to allocate here: segment and stack pages are
+	 * given a frame by vm_fault the first time they are touched,
+	 * and segment pages are read from the executable then.
+	 */
+	KASSERT(as->as_pt != NULL);
+	KASSERT(!as->complete);
+
+	return 0;
 }
 
 int
-as_prepare_load(struct addrspace *as)
+as_complete_load(struct addrspace *as)
 {
+	struct vmregion *vr;
+	vaddr_t heapbase;
+	unsigned num;
+	int result;
+
+	/* The heap starts out empty just past the highest segment */
+	num = vmregionarray_num(&as->as_regions);
+	if (num == 0) {
+		return ENOEXEC;
+	}
+	heapbase = vmregionarray_get(&as->as_regions, num - 1)->vr_top;
+	vr = as_newregion(heapbase, heapbase, VR_HEAP, 1);
+	if (vr == NULL) {
+		return ENOMEM;
+	}
+	result = as_addregion(as, vr);
+	if (result) {
+		kfree(vr);
+		return result;
+	}
+	as->as_heap = vr;
+	as->as_heaptop = heapbase;
+
+	as->complete = 1;
+
 	/*
-	 * Write this.
+	 * Segments are read in on demand by the kernel rather than
+	 * copied in through user addresses, so nothing was mapped
+	 * writable while complete was 0 and there's nothing to flush.
 	 */
-	KASSERT(as->as_pbase1 == 0);
-	KASSERT(as->as_pbase2 == 0);
-        KASSERT(as->as_stackpbase == 0);
+	return 0;
+}
 
-	as->as_pbase1 = KVADDR_TO_PADDR(alloc_kpages(as->as_npages1));
-        if (as->as_pbase1 == 0) {
-                return ENOMEM;
-        }
+int
+as_define_stack(struct addrspace *as, vaddr_t *stackptr)
+{
+	struct vmregion *vr;
+	int result;
 
-	as->as_pbase2 = KVADDR_TO_PADDR(alloc_kpages(as->as_npages2));
-	if (as->as_pbase2 == 0) {
+	/*
+	 * The stack may reach all the way down to its limit. The page
+	 * below that is left out of every region, as a guard.
+	 */
+	vr = as_newregion(as->as_stacklimit, USERSTACK, VR_STACK, 1);
+	if (vr == NULL) {
 		return ENOMEM;
 	}
+	result = as_addregion(as, vr);
+	if (result) {
+		kfree(vr);
+		return result;
+	}
+	as->as_stack = vr;
+
+	/* Initial user-level stack pointer */
+	*stackptr = USERSTACK;
+
+	return 0;
+}
+
+vaddr_t
+as_heaplimit(struct addrspace *as)
+{
+	struct vmregion *next;
+	unsigned i;
+
+	KASSERT(as->as_heap != NULL);
+
+	/* The search skips the heap itself only if it's empty */
+	i = as_regionindex(as, as->as_heap->vr_base);
+	if (i < vmregionarray_num(&as->as_regions) &&
+	    vmregionarray_get(&as->as_regions, i) == as->as_heap) {
+		i++;
+	}
+	if (i == vmregionarray_num(&as->as_regions)) {
+		return as->as_stacklimit - PAGE_SIZE;
+	}
+	next = vmregionarray_get(&as->as_regions, i);
+	if (next == as->as_stack) {
+		/* Keep off the guard page */
+		return next->vr_base - PAGE_SIZE;
+	}
+	return next->vr_base;
+}
+
+int
+as_define_file(struct addrspace *as, struct vnode *v, off_t offset,
+	       vaddr_t vaddr, size_t memsz, size_t filesz)
+{
+	struct vmregion *vr;
+	struct stat st;
+	int result;
 
-	as->as_stackpbase = KVADDR_TO_PADDR(alloc_kpages(VM_STACKPAGES));
-	if (as->as_stackpbase == 0) {
-                return ENOMEM;
-        }
+	if (filesz > memsz) {
+		kprintf("ELF: warning: segment filesize > segment memsize\n");
+		filesz = memsz;
+	}
 
-	as_zero_region(as->as_pbase1, as->as_npages1);
-	as_zero_region(as->as_pbase2, as->as_npages2);
-        as_zero_region(as->as_stackpbase, VM_STACKPAGES);
+	/* Catch a truncated executable now rather than at fault time */
+	result = VOP_STAT(v, &st);
+	if (result) {
+		return result;
+	}
+	if (offset + filesz > st.st_size) {
+		kprintf("ELF: segment past end of file - file truncated?\n");
+		return ENOEXEC;
+	}
+
+	DEBUG(DB_EXEC, "ELF: %lu bytes at 0x%lx to be read on demand\n",
+	      (unsigned long) filesz, (unsigned long) vaddr);
+
+	vr = as_findregion(as, vaddr);
+	if (vr == NULL || vr->vr_type != VR_SEGMENT ||
+	    vr->vr_base != (vaddr & PAGE_FRAME)) {
+		return EINVAL;
+	}
+	vr->vr_filevaddr = vaddr;
+	vr->vr_fileoff = offset;
+	vr->vr_filesz = filesz;
 
+	if (as->as_vn == NULL) {
+		VOP_INCREF(v);
+		as->as_vn = v;
+	}
+	KASSERT(as->as_vn == v);
+
+	/* Everyone running this file shares its read-only pages */
+	if (!vr->vr_writable && as->as_textpc == NULL) {
+		result = pagecache_get(v, &as->as_textpc);
+		if (result) {
+			return result;
+		}
+	}
 	return 0;
 }
 
 int
-as_complete_load(struct addrspace *as)
+as_fillpage(struct addrspace *as, struct vmregion *vr, vaddr_t vaddr,
+	    paddr_t paddr)
 {
-	/*
-	 * Write this.
-	 */
+	struct iovec iov;
+	struct uio ku;
+	vaddr_t kva, fva, start, end;
+	int result;
 
+	KASSERT((vaddr & PAGE_FRAME) == vaddr);
+	kva = PADDR_TO_KVADDR(paddr);
 
-	as->complete = 1;
+	if (vr->vr_type != VR_SEGMENT || as->as_vn == NULL) {
+		return 0;
+	}
+
+	/* The part of this page that comes from the file; BSS stays zero */
+	fva = vr->vr_filevaddr;
+	start = vaddr > fva ? vaddr : fva;
+	end = vaddr + PAGE_SIZE < fva + vr->vr_filesz ? vaddr + PAGE_SIZE :
+		fva + vr->vr_filesz;
+	if (start >= end) {
+		return 0;
+	}
+	uio_kinit(&iov, &ku, (void *)(kva + (start - vaddr)), end - start,
+		  vr->vr_fileoff + (start - fva), UIO_READ);
+	result = VOP_READ(as->as_vn, &ku);
+	if (result) {
+		return result;
+	}
+	if (ku.uio_resid != 0) {
+		kprintf("ELF: short read on segment - file truncated?\n");
+		return ENOEXEC;
+	}
 	return 0;
 }
 
 int
-as_define_stack(struct addrspace *as, vaddr_t *stackptr)
+as_textpage(struct addrspace *as, struct vmregion *vr, vaddr_t vaddr,
+	    paddr_t *ret)
 {
+	off_t pos;
+
+	KASSERT((vaddr & PAGE_FRAME) == vaddr);
+	*ret = 0;
+
+	if (as->as_textpc == NULL || vr->vr_type != VR_SEGMENT ||
+	    vr->vr_writable) {
+		return 0;
+	}
+
 	/*
-	 * Write this.
+	 * A cached page is a whole page of the file, so it will only
+	 * do if the page is file data from end to end and lines up
+	 * with a page of the file. Partial pages at either end of the
+	 * segment are read privately so whatever isn't file data
+	 * reads as zero.
 	 */
+	if (vaddr < vr->vr_filevaddr ||
+	    vaddr + PAGE_SIZE > vr->vr_filevaddr + vr->vr_filesz) {
+		return 0;
+	}
+	pos = vr->vr_fileoff + (vaddr - vr->vr_filevaddr);
+	if (pos % PAGE_SIZE != 0) {
+		return 0;
+	}
+	return pagecache_getpage(as->as_textpc, pos / PAGE_SIZE, ret);
+}
 
-	(void)as;
+int
+as_mmap(struct addrspace *as, size_t npages, int writable, int shared,
+	struct pagecache *pc, unsigned pgoff, vaddr_t *ret)
+{
+	struct vmregion *vr, *below;
+	vaddr_t top, size;
+	unsigned i;
+	int result;
 
-	/* Initial user-level stack pointer */
-	*stackptr = USERSTACK;
+	KASSERT(as->as_heap != NULL && as->as_stack != NULL);
+
+	size = npages * PAGE_SIZE;
+	if (npages == 0 || size / PAGE_SIZE != npages) {
+		return ENOMEM;
+	}
+
+	/*
+	 * Take the highest gap that's big enough, going down from the
+	 * guard page under the stack (which is the last region) as far
+	 * as the heap.
+	 */
+	top = as->as_stack->vr_base - PAGE_SIZE;
+	i = vmregionarray_num(&as->as_regions) - 1;
+	KASSERT(vmregionarray_get(&as->as_regions, i) == as->as_stack);
+	while (1) {
+		KASSERT(i > 0);
+		below = vmregionarray_get(&as->as_regions, --i);
+		if (top - below->vr_top >= size) {
+			break;
+		}
+		if (below == as->as_heap) {
+			return ENOMEM;
+		}
+		top = below->vr_base;
+	}
 
+	vr = as_newregion(top - size, top, VR_MMAP, writable);
+	if (vr == NULL) {
+		return ENOMEM;
+	}
+	vr->vr_pgoff = pgoff;
+	vr->vr_shared = shared;
+	result = as_addregion(as, vr);
+	if (result) {
+		kfree(vr);
+		return result;
+	}
+	vr->vr_pc = pc;
+
+	*ret = vr->vr_base;
 	return 0;
 }
 
+int
+as_munmap(struct addrspace *as, vaddr_t vaddr, size_t npages)
+{
+	struct vmregion *vr, *tail;
+	vaddr_t start, stop, end;
+	unsigned i;
+	size_t n;
+	int result;
+
+	end = vaddr + npages * PAGE_SIZE;
+	i = as_regionindex(as, vaddr);
+	while (i < vmregionarray_num(&as->as_regions)) {
+		vr = vmregionarray_get(&as->as_regions, i);
+		if (vr->vr_base >= end) {
+			break;
+		}
+		if (vr->vr_type != VR_MMAP) {
+			i++;
+			continue;
+		}
+		/* the part of [vaddr, end) inside this mapping */
+		start = vaddr > vr->vr_base ? vaddr : vr->vr_base;
+		stop = end < vr->vr_top ? end : vr->vr_top;
+		n = (stop - start) / PAGE_SIZE;
+
+		/* Cutting a hole in the middle leaves two mappings */
+		tail = NULL;
+		if (start > vr->vr_base && stop < vr->vr_top) {
+			tail = as_newregion(stop, vr->vr_top, VR_MMAP,
+					    vr->vr_writable);
+			if (tail == NULL) {
+				return ENOMEM;
+			}
+			tail->vr_pgoff = vr->vr_pgoff +
+				(stop - vr->vr_base) / PAGE_SIZE;
+			tail->vr_shared = vr->vr_shared;
+			vr->vr_top = start;
+			result = as_addregion(as, tail);
+			if (result) {
+				vr->vr_top = tail->vr_top;
+				kfree(tail);
+				return result;
+			}
+			tail->vr_pc = vr->vr_pc;
+			pagecache_incref(vr->vr_pc);
+		}
+
+		pagetable_unmap(as->as_pt, start, n);
+		if (vr->vr_shared) {
+			(void)pagecache_sync(vr->vr_pc, vr->vr_pgoff +
+					     (start - vr->vr_base) / PAGE_SIZE,
+					     n);
+		}
+
+		if (tail != NULL) {
+			/* skip the tail too; it's past END */
+			i += 2;
+		}
+		else if (start == vr->vr_base && stop == vr->vr_top) {
+			vmregionarray_remove(&as->as_regions, i);
+			as->as_lastregion = NULL;
+			pagecache_release(vr->vr_pc);
+			kfree(vr);
+		}
+		else {
+			if (start == vr->vr_base) {
+				vr->vr_base = stop;
+				vr->vr_pgoff += n;
+			}
+			else {
+				vr->vr_top = start;
+			}
+			i++;
+		}
+	}
+	return 0;
+}
+
+int
+as_msync(struct addrspace *as, vaddr_t vaddr, size_t npages)
+{
+	struct vmregion *vr;
+	vaddr_t start, stop, end;
+	unsigned i;
+	int result;
+
+	end = vaddr + npages * PAGE_SIZE;
+	for (i = as_regionindex(as, vaddr);
+	     i < vmregionarray_num(&as->as_regions); i++) {
+		vr = vmregionarray_get(&as->as_regions, i);
+		if (vr->vr_base >= end) {
+			break;
+		}
+		if (vr->vr_type != VR_MMAP || !vr->vr_shared) {
+			continue;
+		}
+		start = vaddr > vr->vr_base ? vaddr : vr->vr_base;
+		stop = end < vr->vr_top ? end : vr->vr_top;
+		result = pagecache_sync(vr->vr_pc, vr->vr_pgoff +
+					(start - vr->vr_base) / PAGE_SIZE,
+					(stop - start) / PAGE_SIZE);
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
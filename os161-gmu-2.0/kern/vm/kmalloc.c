@@ -30,7 +30,10 @@
 #include <types.h>
 #include <lib.h>
 #include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
 #include <vm.h>
+#include <platform/maxcpus.h>
 
 /*
  * Kernel malloc.
@@ -145,7 +148,7 @@ struct freelist {
 
 struct pageref {
 	struct pageref *next_samesize;
-	struct pageref *next_all;
+	struct pageref **prevp_samesize;	/* the link that points to us */
 	vaddr_t pageaddr_and_blocktype;
 	uint16_t freelist_offset;
 	uint16_t nfree;
@@ -160,14 +163,55 @@ struct pageref {
 ////////////////////////////////////////
 
 /*
- * Use one spinlock for the whole thing. Making parts of the kmalloc
- * logic per-cpu is worthwhile for scalability; however, for the time
- * being at least we won't, because it adds a lot of complexity and in
- * OS/161 performance and scalability aren't super-critical.
+ * One spinlock protects the pages and their lists. Blocks mostly come
+ * and go through the per-CPU caches in front of it, so it's only
+ * taken to refill or flush those a batch at a time.
  */
 
 static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
 
+/*
+ * Per-CPU block caches ("magazines").
+ *
+ * Each CPU keeps up to KC_SIZE free blocks of each size. kmalloc
+ * takes from, and kfree gives back to, the current CPU's cache under
+ * that cache's own lock, which nobody else wants except to drain it,
+ * so the usual case doesn't touch kmalloc_spinlock at all. An empty
+ * cache is refilled, and a full one flushed back to the heap pages,
+ * KC_BATCH blocks at a time.
+ *
+ * Cached blocks are deadbeefed like free ones but count as allocated
+ * as far as their pages are concerned, so a page whose blocks sit in
+ * caches isn't given back; kheap_drain returns them all when memory
+ * gets short. CHECKGUARDS would find them without guard bands, so the
+ * caches are skipped when it's on.
+ *
+ * The lock order is a CPU's cache lock, then kmalloc_spinlock.
+ */
+#define KC_SIZE		16
+#define KC_BATCH	8
+
+#ifdef CHECKGUARDS
+#define KC_ENABLED	0
+#else
+#define KC_ENABLED	1
+#endif
+
+struct kmcache {
+	struct spinlock kc_lock;
+	unsigned kc_count[NSIZES];
+	vaddr_t kc_blocks[NSIZES][KC_SIZE];
+};
+
+/* All zero, which is the same as SPINLOCK_INITIALIZER for the locks */
+static struct kmcache kmcaches[MAXCPUS];
+
+/*
+ * kmalloc calls made on each CPU (before there are CPUs, on the
+ * first), for kheap_nallocs. Each CPU only writes its own.
+ */
+static unsigned kmalloc_calls[MAXCPUS];
+
 ////////////////////////////////////////
 
 /*
@@ -198,19 +242,14 @@ struct kheap_root {
 };
 
 /*
- * It would be better to make this dynamically sizeable. However,
- * since we only actually run on System/161 and System/161 is
- * specifically limited to 16M of RAM, we'll just adopt that as a
- * static size limit.
- *
- * FUTURE: it would be better to pick this number based on the RAM
- * size we find at boot time.
+ * There's one root per NPAGEREFS_PER_PAGE frames of RAM, so there are
+ * enough pagerefs for the heap to fill all of memory however much of
+ * it the machine has. kheap_bootstrap allocates the roots once the VM
+ * system knows the RAM size; the pageref pages themselves are only
+ * allocated as the heap grows into them.
  */
-
-#define NUM_PAGEREFPAGES 16
-#define TOTAL_PAGEREFS (NUM_PAGEREFPAGES * NPAGEREFS_PER_PAGE)
-
-static struct kheap_root kheaproots[NUM_PAGEREFPAGES];
+static struct kheap_root *kheaproots;
+static unsigned kheap_nroots;
 
 /*
  * Allocate a page to hold pagerefs.
@@ -262,7 +301,7 @@ allocpageref(void)
 	unsigned whichroot;
 	struct kheap_root *root;
 
-	for (whichroot=0; whichroot < NUM_PAGEREFPAGES; whichroot++) {
+	for (whichroot=0; whichroot < kheap_nroots; whichroot++) {
 		root = &kheaproots[whichroot];
 		if (root->numinuse >= NPAGEREFS_PER_PAGE) {
 			continue;
@@ -310,7 +349,7 @@ freepageref(struct pageref *p)
 	struct kheap_root *root;
 	struct pagerefpage *page;
 
-	for (whichroot=0; whichroot < NUM_PAGEREFPAGES; whichroot++) {
+	for (whichroot=0; whichroot < kheap_nroots; whichroot++) {
 		root = &kheaproots[whichroot];
 
 		page = root->page;
@@ -339,11 +378,154 @@ freepageref(struct pageref *p)
 ////////////////////////////////////////
 
 /*
- * Each pageref is on two linked lists: one list of pages of blocks of
- * that same size, and one of all blocks.
+ * Each pageref is on one of three lists for its block size, by how
+ * many free blocks its page has: some but not all (partial), none
+ * (full) or all of them (empty). Blocks come from the first partial
+ * page, or failing that the first empty one, so finding a free block
+ * takes no searching; a page moves from list to list as it fills up
+ * and empties out, and the lists are doubly linked so that's constant
+ * time too.
+ *
+ * Empty pages are kept for reuse, up to EMPTY_HIGH of each size. Past
+ * that they're given back until only EMPTY_LOW are left, so a size
+ * whose use hovers around a page boundary doesn't get and free a page
+ * every other call. kheap_drain gives them all back.
+ */
+#define PL_PARTIAL	0
+#define PL_FULL		1
+#define PL_EMPTY	2
+#define NPAGELISTS	3
+
+#define EMPTY_HIGH	4
+#define EMPTY_LOW	1
+
+static struct pageref *pagelists[NSIZES][NPAGELISTS];
+static unsigned numempty[NSIZES];
+
+/*
+ * Which list PR belongs on, going by its free count.
+ */
+static
+unsigned
+pagelist_which(struct pageref *pr)
+{
+	if (pr->nfree == 0) {
+		return PL_FULL;
+	}
+	if (pr->nfree == PAGE_SIZE / sizes[PR_BLOCKTYPE(pr)]) {
+		return PL_EMPTY;
+	}
+	return PL_PARTIAL;
+}
+
+/*
+ * Put PR on the list its free count says.
  */
-static struct pageref *sizebases[NSIZES];
-static struct pageref *allbase;
+static
+void
+pagelist_add(struct pageref *pr)
+{
+	struct pageref **head;
+	unsigned blktype, which;
+
+	blktype = PR_BLOCKTYPE(pr);
+	which = pagelist_which(pr);
+	head = &pagelists[blktype][which];
+
+	pr->next_samesize = *head;
+	if (*head != NULL) {
+		(*head)->prevp_samesize = &pr->next_samesize;
+	}
+	pr->prevp_samesize = head;
+	*head = pr;
+	if (which == PL_EMPTY) {
+		numempty[blktype]++;
+	}
+}
+
+/*
+ * Take PR off list WHICH, the one it's on.
+ */
+static
+void
+pagelist_remove(struct pageref *pr, unsigned which)
+{
+	*pr->prevp_samesize = pr->next_samesize;
+	if (pr->next_samesize != NULL) {
+		pr->next_samesize->prevp_samesize = pr->prevp_samesize;
+	}
+	pr->next_samesize = NULL;
+	pr->prevp_samesize = NULL;
+	if (which == PL_EMPTY) {
+		KASSERT(numempty[PR_BLOCKTYPE(pr)] > 0);
+		numempty[PR_BLOCKTYPE(pr)]--;
+	}
+}
+
+/*
+ * The pageref of each heap page, by frame number, so kfree can tell
+ * which size a block is (and whether it's a subpage block at all)
+ * without searching the lists or taking the lock. An entry only
+ * changes under kmalloc_spinlock, when its page goes on or comes off
+ * the lists, and a page can't come off while any of its blocks is
+ * allocated, so the entry for a block being freed is stable. Set up
+ * by kheap_bootstrap with the roots, one entry per frame of RAM.
+ */
+static struct pageref **pagerefs_byframe;
+static paddr_t kheap_nframes;
+
+static
+void
+pageref_setframe(vaddr_t prpage, struct pageref *pr)
+{
+	paddr_t frame;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	frame = KVADDR_TO_PADDR(prpage) / PAGE_SIZE;
+	KASSERT(frame < kheap_nframes);
+	pagerefs_byframe[frame] = pr;
+}
+
+static
+struct pageref *
+pageref_lookup(vaddr_t addr)
+{
+	paddr_t frame;
+
+	frame = KVADDR_TO_PADDR(addr) / PAGE_SIZE;
+	if (frame >= kheap_nframes) {
+		return NULL;
+	}
+	return pagerefs_byframe[frame];
+}
+
+/*
+ * Size the roots and pagerefs_byframe for physical memory ending at
+ * TOPADDR. Called once by vm_bootstrap, before anything is kmalloc'd.
+ */
+void
+kheap_bootstrap(paddr_t topaddr)
+{
+	size_t rootsize, framesize;
+	vaddr_t va;
+
+	KASSERT(kheaproots == NULL);
+
+	kheap_nframes = topaddr / PAGE_SIZE;
+	kheap_nroots = DIVROUNDUP(kheap_nframes, NPAGEREFS_PER_PAGE);
+	rootsize = kheap_nroots * sizeof(struct kheap_root);
+	framesize = kheap_nframes * sizeof(struct pageref *);
+
+	va = alloc_kpages(DIVROUNDUP(rootsize + framesize, PAGE_SIZE));
+	if (va == 0) {
+		panic("kheap_bootstrap: Out of memory\n");
+	}
+	bzero((void *)va, rootsize + framesize);
+
+	/* the pointers first, so they stay aligned */
+	pagerefs_byframe = (struct pageref **)va;
+	kheaproots = (struct kheap_root *)(va + framesize);
+}
 
 ////////////////////////////////////////
 
@@ -579,27 +761,32 @@ static
 void
 checksubpages(void)
 {
-	struct pageref *pr;
-	int i;
-	unsigned sc=0, ac=0;
+	struct pageref *pr, **prevp;
+	int i, l;
+	unsigned sc=0, ec;
 
 	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
 
 	for (i=0; i<NSIZES; i++) {
-		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
-			checksubpage(pr);
-			KASSERT(sc < TOTAL_PAGEREFS);
-			sc++;
+		ec = 0;
+		for (l=0; l<NPAGELISTS; l++) {
+			prevp = &pagelists[i][l];
+			for (pr = *prevp; pr != NULL; pr = pr->next_samesize) {
+				checksubpage(pr);
+				KASSERT(PR_BLOCKTYPE(pr) == i);
+				KASSERT(pagelist_which(pr) == (unsigned)l);
+				KASSERT(pr->prevp_samesize == prevp);
+				prevp = &pr->next_samesize;
+				KASSERT(sc < kheap_nroots *
+					NPAGEREFS_PER_PAGE);
+				sc++;
+				if (l == PL_EMPTY) {
+					ec++;
+				}
+			}
 		}
+		KASSERT(ec == numempty[i]);
 	}
-
-	for (pr = allbase; pr != NULL; pr = pr->next_all) {
-		checksubpage(pr);
-		KASSERT(ac < TOTAL_PAGEREFS);
-		ac++;
-	}
-
-	KASSERT(sc==ac);
 }
 #else
 #define checksubpages()
@@ -681,12 +868,15 @@ void
 dump_subpages(unsigned generation)
 {
 	struct pageref *pr;
-	int i;
+	int i, l;
 
 	kprintf("Remaining allocations from generation %u:\n", generation);
 	for (i=0; i<NSIZES; i++) {
-		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
-			dump_subpage(pr, generation);
+		for (l=0; l<NPAGELISTS; l++) {
+			for (pr = pagelists[i][l]; pr != NULL;
+			     pr = pr->next_samesize) {
+				dump_subpage(pr, generation);
+			}
 		}
 	}
 }
@@ -801,49 +991,53 @@ void
 kheap_printstats(void)
 {
 	struct pageref *pr;
+	unsigned c, i, l, n;
+	unsigned counts[NPAGELISTS];
 
 	/* print the whole thing with interrupts off */
 	spinlock_acquire(&kmalloc_spinlock);
 
 	kprintf("Subpage allocator status:\n");
 
-	for (pr = allbase; pr != NULL; pr = pr->next_all) {
-		subpage_stats(pr);
+	for (i = 0; i < NSIZES; i++) {
+		for (l = 0; l < NPAGELISTS; l++) {
+			counts[l] = 0;
+			for (pr = pagelists[i][l]; pr != NULL;
+			     pr = pr->next_samesize) {
+				subpage_stats(pr);
+				counts[l]++;
+			}
+		}
+		if (counts[PL_PARTIAL] + counts[PL_FULL] + counts[PL_EMPTY]) {
+			kprintf("size %-4lu pages: %u partial, %u full, "
+				"%u empty\n", (unsigned long) sizes[i],
+				counts[PL_PARTIAL], counts[PL_FULL],
+				counts[PL_EMPTY]);
+		}
 	}
 
 	spinlock_release(&kmalloc_spinlock);
-}
-
-////////////////////////////////////////
 
-/*
- * Remove a pageref from both lists that it's on.
- */
-static
-void
-remove_lists(struct pageref *pr, int blktype)
-{
-	struct pageref **guy;
-
-	KASSERT(blktype>=0 && blktype<NSIZES);
-
-	for (guy = &sizebases[blktype]; *guy; guy = &(*guy)->next_samesize) {
-		checksubpage(*guy);
-		if (*guy == pr) {
-			*guy = pr->next_samesize;
-			break;
+	/* Blocks in the caches show up as allocated ('*') above */
+	kprintf("Cached free blocks by size:\n");
+	for (c = 0; c < MAXCPUS; c++) {
+		for (i = 0, n = 0; i < NSIZES; i++) {
+			n += kmcaches[c].kc_count[i];
 		}
-	}
-
-	for (guy = &allbase; *guy; guy = &(*guy)->next_all) {
-		checksubpage(*guy);
-		if (*guy == pr) {
-			*guy = pr->next_all;
-			break;
+		if (n == 0) {
+			continue;
 		}
+		kprintf("   cpu%-2u", c);
+		for (i = 0; i < NSIZES; i++) {
+			kprintf(" %4lu:%-2u", (unsigned long) sizes[i],
+				kmcaches[c].kc_count[i]);
+		}
+		kprintf("\n");
 	}
 }
 
+////////////////////////////////////////
+
 /*
  * Given a requested client size, return the block type, that is, the
  * index into the sizes[] array for the block size to use.
@@ -867,101 +1061,340 @@ int blocktype(size_t clientsz)
 }
 
 /*
- * Allocate a block of size SZ, where SZ is not large enough to
- * warrant a whole-page allocation.
+ * Take one block off PR's freelist. PR must have a free block.
  */
 static
 void *
-subpage_kmalloc(size_t sz
-#ifdef LABELS
-		, vaddr_t label
-#endif
-	)
+subpage_pop(struct pageref *pr)
 {
-	unsigned blktype;	// index into sizes[] that we're using
-	struct pageref *pr;	// pageref for page we're allocating from
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
 	vaddr_t fla;		// free list entry address
-	struct freelist *volatile fl;	// free list entry
+	struct freelist *fl;	// free list entry
 	void *retptr;		// our result
+	unsigned which;		// list PR was on
 
-	volatile int i;
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	KASSERT(pr->nfree > 0);
+	KASSERT(pr->freelist_offset < PAGE_SIZE);
+	prpage = PR_PAGEADDR(pr);
+	fla = prpage + pr->freelist_offset;
+	fl = (struct freelist *)fla;
 
-#ifdef GUARDS
-	size_t clientsz;
-#endif
+	which = pagelist_which(pr);
+	pr->nfree--;
+	if (pagelist_which(pr) != which) {
+		pagelist_remove(pr, which);
+		pagelist_add(pr);
+	}
 
-#ifdef GUARDS
-	clientsz = sz;
-	sz += GUARD_OVERHEAD;
-#endif
-#ifdef LABELS
-#ifdef GUARDS
-	/* Include the label in what GUARDS considers the client data. */
-	clientsz += LABEL_PTROFFSET;
-#endif
-	sz += LABEL_PTROFFSET;
+	retptr = fl;
+	fl = fl->next;
+
+	if (fl != NULL) {
+		KASSERT(pr->nfree > 0);
+		fla = (vaddr_t)fl;
+		KASSERT(fla - prpage < PAGE_SIZE);
+		pr->freelist_offset = fla - prpage;
+	}
+	else {
+		KASSERT(pr->nfree == 0);
+		pr->freelist_offset = INVALID_OFFSET;
+	}
+	return retptr;
+}
+
+/*
+ * Take a free block of type BLKTYPE from a partly used page, or else
+ * an empty one, or return NULL if there are neither.
+ */
+static
+void *
+subpage_getblock(unsigned blktype)
+{
+	struct pageref *pr;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	pr = pagelists[blktype][PL_PARTIAL];
+	if (pr == NULL) {
+		pr = pagelists[blktype][PL_EMPTY];
+	}
+	if (pr == NULL) {
+		return NULL;
+	}
+
+	/* check for corruption */
+	KASSERT(PR_BLOCKTYPE(pr) == blktype);
+	checksubpage(pr);
+
+	return subpage_pop(pr);
+}
+
+/*
+ * Put the (already deadbeefed) block at PTRADDR back on its page's
+ * freelist.
+ */
+static
+void
+subpage_putblock(struct pageref *pr, vaddr_t ptraddr)
+{
+	int blktype;		// index into sizes[] that we're using
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t offset;		// offset into page
+	struct freelist *fl;	// free list entry
+	unsigned which;		// list PR was on
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	checksubpage(pr);
+
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
+	offset = ptraddr - prpage;
+
+	/*
+	 * We probably ought to check for free twice by seeing if the block
+	 * is already on the free list. But that's expensive, so we don't.
+	 */
+
+	fl = (struct freelist *)ptraddr;
+	if (pr->freelist_offset == INVALID_OFFSET) {
+		fl->next = NULL;
+	} else {
+		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
+
+		/* this block should not already be on the free list! */
+#ifdef SLOW
+		{
+			struct freelist *fl2;
+
+			for (fl2 = fl->next; fl2 != NULL; fl2 = fl2->next) {
+				KASSERT(fl2 != fl);
+			}
+		}
+#else
+		/* check just the head */
+		KASSERT(fl != fl->next);
 #endif
-	blktype = blocktype(sz);
-	sz = sizes[blktype];
+	}
+	pr->freelist_offset = offset;
+	which = pagelist_which(pr);
+	pr->nfree++;
 
-	spinlock_acquire(&kmalloc_spinlock);
+	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
+	if (pagelist_which(pr) != which) {
+		pagelist_remove(pr, which);
+		pagelist_add(pr);
+	}
+}
 
-	checksubpages();
+/*
+ * If there are more than EMPTY_HIGH empty pages of type BLKTYPE, take
+ * all but EMPTY_LOW of them off the lists, up to EMPTY_HIGH, and store
+ * their addresses in FREEPAGES for the caller to free_kpages once it
+ * has let go of kmalloc_spinlock. (With FORCE, take every empty page,
+ * still up to EMPTY_HIGH.) Returns how many.
+ */
+static
+unsigned
+subpage_reap(unsigned blktype, bool force, vaddr_t *freepages)
+{
+	struct pageref *pr;
+	unsigned keep, n = 0;
 
-	for (pr = sizebases[blktype]; pr != NULL; pr = pr->next_samesize) {
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
 
-		/* check for corruption */
-		KASSERT(PR_BLOCKTYPE(pr) == blktype);
+	if (!force && numempty[blktype] <= EMPTY_HIGH) {
+		return 0;
+	}
+	keep = force ? 0 : EMPTY_LOW;
+	while (numempty[blktype] > keep && n < EMPTY_HIGH) {
+		pr = pagelists[blktype][PL_EMPTY];
 		checksubpage(pr);
+		pagelist_remove(pr, PL_EMPTY);
+		freepages[n++] = PR_PAGEADDR(pr);
+		pageref_setframe(PR_PAGEADDR(pr), NULL);
+		freepageref(pr);
+	}
+	return n;
+}
 
-		if (pr->nfree > 0) {
+////////////////////////////////////////
 
-		doalloc: /* comes here after getting a whole fresh page */
+/*
+ * Move up to N blocks of type BLKTYPE from KC back to their pages.
+ * The caller holds KC's lock. Empty pages to be given back are stored
+ * in FREEPAGES (which must have room for EMPTY_HIGH) for the caller
+ * to release; returns how many.
+ */
+static
+unsigned
+kmcache_flush(struct kmcache *kc, unsigned blktype, unsigned n,
+	      vaddr_t *freepages)
+{
+	vaddr_t block;
+	unsigned nfreed;
+
+	spinlock_acquire(&kmalloc_spinlock);
+	while (kc->kc_count[blktype] > 0 && n-- > 0) {
+		block = kc->kc_blocks[blktype][--kc->kc_count[blktype]];
+		subpage_putblock(pageref_lookup(block), block);
+	}
+	nfreed = subpage_reap(blktype, false, freepages);
+	spinlock_release(&kmalloc_spinlock);
+	return nfreed;
+}
 
-			KASSERT(pr->freelist_offset < PAGE_SIZE);
-			prpage = PR_PAGEADDR(pr);
-			fla = prpage + pr->freelist_offset;
-			fl = (struct freelist *)fla;
+/*
+ * Get a free block of type BLKTYPE from this CPU's cache, refilling
+ * it from the heap pages if it's empty. Returns NULL if the cache
+ * can't be used or every page of this size is full.
+ */
+static
+void *
+kmcache_get(unsigned blktype)
+{
+	struct kmcache *kc;
+	void *block;
+	unsigned *count;
 
-			retptr = fl;
-			fl = fl->next;
-			pr->nfree--;
+	if (!KC_ENABLED || !CURCPU_EXISTS()) {
+		return NULL;
+	}
+	kc = &kmcaches[curcpu->c_number];
+	count = &kc->kc_count[blktype];
 
-			if (fl != NULL) {
-				KASSERT(pr->nfree > 0);
-				fla = (vaddr_t)fl;
-				KASSERT(fla - prpage < PAGE_SIZE);
-				pr->freelist_offset = fla - prpage;
-			}
-			else {
-				KASSERT(pr->nfree == 0);
-				pr->freelist_offset = INVALID_OFFSET;
+	spinlock_acquire(&kc->kc_lock);
+	if (*count == 0) {
+		spinlock_acquire(&kmalloc_spinlock);
+		checksubpages();
+		while (*count < KC_BATCH) {
+			block = subpage_getblock(blktype);
+			if (block == NULL) {
+				break;
 			}
-#ifdef GUARDS
-			retptr = establishguardband(retptr, clientsz, sz);
-#endif
-#ifdef LABELS
-			retptr = establishlabel(retptr, label);
-#endif
+			kc->kc_blocks[blktype][(*count)++] = (vaddr_t)block;
+		}
+		spinlock_release(&kmalloc_spinlock);
+	}
+	block = NULL;
+	if (*count > 0) {
+		block = (void *)kc->kc_blocks[blktype][--*count];
+	}
+	spinlock_release(&kc->kc_lock);
+	return block;
+}
+
+/*
+ * Give the free block at BLOCK back through this CPU's cache. Returns
+ * false if the cache can't be used.
+ */
+static
+bool
+kmcache_put(unsigned blktype, vaddr_t block)
+{
+	struct kmcache *kc;
+	vaddr_t freepages[EMPTY_HIGH];
+	unsigned i, nfreed = 0;
+
+	if (!KC_ENABLED || !CURCPU_EXISTS()) {
+		return false;
+	}
+	kc = &kmcaches[curcpu->c_number];
 
-			checksubpages();
+	spinlock_acquire(&kc->kc_lock);
+	if (kc->kc_count[blktype] == KC_SIZE) {
+		nfreed = kmcache_flush(kc, blktype, KC_BATCH, freepages);
+	}
+	kc->kc_blocks[blktype][kc->kc_count[blktype]++] = block;
+	spinlock_release(&kc->kc_lock);
 
-			spinlock_release(&kmalloc_spinlock);
-			return retptr;
+	/* Call free_kpages without holding any of our locks. */
+	for (i = 0; i < nfreed; i++) {
+		free_kpages(freepages[i]);
+	}
+	return true;
+}
+
+/*
+ * Empty every CPU's cache back into the heap pages and release the
+ * pages that leaves wholly free. Returns how many pages that was.
+ */
+unsigned
+kheap_drain(void)
+{
+	struct kmcache *kc;
+	vaddr_t freepages[EMPTY_HIGH];
+	unsigned c, blktype, i, n, total = 0;
+
+	for (c = 0; c < MAXCPUS; c++) {
+		kc = &kmcaches[c];
+		for (blktype = 0; blktype < NSIZES; blktype++) {
+			do {
+				spinlock_acquire(&kc->kc_lock);
+				n = kmcache_flush(kc, blktype, KC_BATCH,
+						  freepages);
+				i = kc->kc_count[blktype];
+				spinlock_release(&kc->kc_lock);
+				total += n;
+				while (n > 0) {
+					free_kpages(freepages[--n]);
+				}
+			} while (i > 0);
 		}
 	}
 
+	/* and the empty pages kept for reuse */
+	for (blktype = 0; blktype < NSIZES; blktype++) {
+		do {
+			spinlock_acquire(&kmalloc_spinlock);
+			n = subpage_reap(blktype, true, freepages);
+			spinlock_release(&kmalloc_spinlock);
+			total += n;
+			for (i = 0; i < n; i++) {
+				free_kpages(freepages[i]);
+			}
+		} while (n > 0);
+	}
+	return total;
+}
+
+/*
+ * Total kmalloc calls since boot.
+ */
+unsigned
+kheap_nallocs(void)
+{
+	unsigned c, total = 0;
+
+	for (c = 0; c < MAXCPUS; c++) {
+		total += kmalloc_calls[c];
+	}
+	return total;
+}
+
+////////////////////////////////////////
+
+/*
+ * Get a fresh page for blocks of type BLKTYPE and put it on the lists.
+ * Called without kmalloc_spinlock; returns with it held on success.
+ */
+static
+struct pageref *
+subpage_newpage(unsigned blktype)
+{
+	struct pageref *pr;	// pageref for the new page
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t fla;		// free list entry address
+	struct freelist *volatile fl;	// free list entry
+
+	volatile int i;
+
 	/*
-	 * No page of the right size available.
-	 * Make a new one.
-	 *
-	 * We release the spinlock while calling alloc_kpages. This
+	 * We don't hold the spinlock while calling alloc_kpages. This
 	 * avoids deadlock if alloc_kpages needs to come back here.
 	 * Note that this means things can change behind our back...
 	 */
 
-	spinlock_release(&kmalloc_spinlock);
 	prpage = alloc_kpages(1);
 	if (prpage==0) {
 		/* Out of memory. */
@@ -1005,14 +1438,74 @@ subpage_kmalloc(size_t sz
 	pr->freelist_offset = fla - prpage;
 	KASSERT(pr->freelist_offset == (pr->nfree-1)*sizes[blktype]);
 
-	pr->next_samesize = sizebases[blktype];
-	sizebases[blktype] = pr;
+	pagelist_add(pr);
 
-	pr->next_all = allbase;
-	allbase = pr;
+	pageref_setframe(prpage, pr);
+	return pr;
+}
 
-	/* This is kind of cheesy, but avoids duplicating the alloc code. */
-	goto doalloc;
+/*
+ * Allocate a block of size SZ, where SZ is not large enough to
+ * warrant a whole-page allocation.
+ */
+static
+void *
+subpage_kmalloc(size_t sz
+#ifdef LABELS
+		, vaddr_t label
+#endif
+	)
+{
+	unsigned blktype;	// index into sizes[] that we're using
+	struct pageref *pr;	// pageref for a fresh page
+	void *retptr;		// our result
+
+#ifdef GUARDS
+	size_t clientsz;
+#endif
+
+#ifdef GUARDS
+	clientsz = sz;
+	sz += GUARD_OVERHEAD;
+#endif
+#ifdef LABELS
+#ifdef GUARDS
+	/* Include the label in what GUARDS considers the client data. */
+	clientsz += LABEL_PTROFFSET;
+#endif
+	sz += LABEL_PTROFFSET;
+#endif
+	blktype = blocktype(sz);
+	sz = sizes[blktype];
+
+	retptr = kmcache_get(blktype);
+	if (retptr == NULL) {
+		spinlock_acquire(&kmalloc_spinlock);
+		checksubpages();
+		retptr = subpage_getblock(blktype);
+		spinlock_release(&kmalloc_spinlock);
+	}
+	if (retptr == NULL) {
+		/*
+		 * No page of the right size available.
+		 * Make a new one.
+		 */
+		pr = subpage_newpage(blktype);
+		if (pr == NULL) {
+			return NULL;
+		}
+		retptr = subpage_pop(pr);
+		checksubpages();
+		spinlock_release(&kmalloc_spinlock);
+	}
+
+#ifdef GUARDS
+	retptr = establishguardband(retptr, clientsz, sz);
+#endif
+#ifdef LABELS
+	retptr = establishlabel(retptr, label);
+#endif
+	return retptr;
 }
 
 /*
@@ -1027,9 +1520,9 @@ subpage_kfree(void *ptr)
 	vaddr_t ptraddr;	// same as ptr
 	struct pageref *pr;	// pageref for page we're freeing in
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
-	vaddr_t fla;		// free list entry address
-	struct freelist *fl;	// free list entry
 	vaddr_t offset;		// offset into page
+	vaddr_t freepages[EMPTY_HIGH];	// empty pages to give back
+	unsigned nfreed;
 #ifdef GUARDS
 	size_t blocksize, smallerblocksize;
 #endif
@@ -1059,30 +1552,15 @@ subpage_kfree(void *ptr)
 	ptraddr -= LABEL_PTROFFSET;
 #endif
 
-	spinlock_acquire(&kmalloc_spinlock);
-
-	checksubpages();
-
-	for (pr = allbase; pr; pr = pr->next_all) {
-		prpage = PR_PAGEADDR(pr);
-		blktype = PR_BLOCKTYPE(pr);
-		KASSERT(blktype >= 0 && blktype < NSIZES);
-
-		/* check for corruption */
-		KASSERT(blktype>=0 && blktype<NSIZES);
-		checksubpage(pr);
-
-		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
-			break;
-		}
-	}
-
+	pr = pageref_lookup(ptraddr);
 	if (pr==NULL) {
 		/* Not on any of our pages - not a subpage allocation */
-		spinlock_release(&kmalloc_spinlock);
 		return -1;
 	}
 
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
+	KASSERT(blktype >= 0 && blktype < NSIZES);
 	offset = ptraddr - prpage;
 
 	/* Check for proper positioning and alignment */
@@ -1102,58 +1580,296 @@ subpage_kfree(void *ptr)
 	 */
 	fill_deadbeef((void *)ptraddr, sizes[blktype]);
 
-	/*
-	 * We probably ought to check for free twice by seeing if the block
-	 * is already on the free list. But that's expensive, so we don't.
-	 */
+	if (kmcache_put(blktype, ptraddr)) {
+		return 0;
+	}
 
-	fla = prpage + offset;
-	fl = (struct freelist *)fla;
-	if (pr->freelist_offset == INVALID_OFFSET) {
-		fl->next = NULL;
-	} else {
-		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
+	spinlock_acquire(&kmalloc_spinlock);
+	checksubpages();
+	subpage_putblock(pr, ptraddr);
+	nfreed = subpage_reap(blktype, false, freepages);
+	checksubpages();
+	spinlock_release(&kmalloc_spinlock);
 
-		/* this block should not already be on the free list! */
-#ifdef SLOW
-		{
-			struct freelist *fl2;
+	/* Call free_kpages without kmalloc_spinlock. */
+	while (nfreed > 0) {
+		free_kpages(freepages[--nfreed]);
+	}
 
-			for (fl2 = fl->next; fl2 != NULL; fl2 = fl2->next) {
-				KASSERT(fl2 != fl);
-			}
+	return 0;
+}
+
+//
+////////////////////////////////////////////////////////////
+
+/*
+ * Allocation profiler.
+ *
+ * While it's on, kmalloc charges each block to the call site it came
+ * from and the size of block it got, and kfree credits it back, so
+ * kheap_profprint can show which call sites are holding the most
+ * memory. Unlike LABELS it needs no rebuild and doesn't change the
+ * heap layout; while it's off kmalloc and kfree each test one word.
+ *
+ * Profiled blocks are found again at kfree time through a hash table
+ * of their addresses. Everything is fixed size: once KPROF_NSITES
+ * site/size pairs are in use the rest are lumped together as site 0,
+ * and allocations made while all KPROF_NBLOCKS block entries are in
+ * use are counted but not followed to kfree, so don't show in the
+ * live bytes. Frees still get matched after profiling is turned off,
+ * until the blocks it was following are all gone.
+ *
+ * kprof_lock is taken with none of the heap's locks held.
+ */
+#define KPROF_NSITES	256		// power of two
+#define KPROF_NBLOCKS	2048
+#define KPROF_NHASH	512		// power of two
+#define KPROF_TOP	32		// most kheap_profprint shows
+
+#define KPROF_SITEHASH(site, blksize) \
+	((((site) >> 2) ^ (blksize)) & (KPROF_NSITES - 1))
+#define KPROF_BLOCKHASH(addr) \
+	((((addr) >> 4) ^ ((addr) >> 12)) & (KPROF_NHASH - 1))
+
+struct kprof_site {
+	vaddr_t ks_site;		// kmalloc's return address; 0 if free
+	size_t ks_blksize;		// block size (or whole pages) it got
+	unsigned ks_allocs;
+	unsigned ks_frees;		// of followed blocks only
+	size_t ks_livebytes;		// likewise
+};
+
+struct kprof_block {
+	vaddr_t kb_addr;
+	size_t kb_blksize;		// the other site mixes sizes
+	struct kprof_site *kb_site;
+	struct kprof_block *kb_next;	// on a hash chain or the free list
+};
+
+static struct spinlock kprof_lock = SPINLOCK_INITIALIZER;
+static volatile bool kprof_on;		// read without the lock
+static volatile unsigned kprof_nblocks;	// blocks followed; likewise
+static bool kprof_ready;		// tables set up
+static unsigned kprof_nsites;
+static unsigned kprof_unfollowed;	// allocations not followed
+static struct kprof_site kprof_sites[KPROF_NSITES];
+static struct kprof_site kprof_othersite;
+static struct kprof_block kprof_blocks[KPROF_NBLOCKS];
+static struct kprof_block *kprof_hash[KPROF_NHASH];
+static struct kprof_block *kprof_freeblocks;
+
+/*
+ * Forget everything. The caller holds kprof_lock.
+ */
+static
+void
+kprof_clear(void)
+{
+	unsigned i;
+
+	bzero(kprof_sites, sizeof(kprof_sites));
+	bzero(&kprof_othersite, sizeof(kprof_othersite));
+	kprof_nsites = 0;
+	kprof_unfollowed = 0;
+	for (i = 0; i < KPROF_NHASH; i++) {
+		kprof_hash[i] = NULL;
+	}
+	kprof_freeblocks = NULL;
+	for (i = 0; i < KPROF_NBLOCKS; i++) {
+		kprof_blocks[i].kb_next = kprof_freeblocks;
+		kprof_freeblocks = &kprof_blocks[i];
+	}
+	kprof_nblocks = 0;
+	kprof_ready = true;
+}
+
+/*
+ * The record for SITE getting blocks of BLKSIZE.
+ */
+static
+struct kprof_site *
+kprof_findsite(vaddr_t site, size_t blksize)
+{
+	struct kprof_site *ks;
+	unsigned i, n;
+
+	i = KPROF_SITEHASH(site, blksize);
+	for (n = 0; n < KPROF_NSITES; n++) {
+		ks = &kprof_sites[(i + n) & (KPROF_NSITES - 1)];
+		if (ks->ks_site == site && ks->ks_blksize == blksize) {
+			return ks;
+		}
+		if (ks->ks_site == 0) {
+			break;
 		}
-#else
-		/* check just the head */
-		KASSERT(fl != fl->next);
-#endif
 	}
-	pr->freelist_offset = offset;
-	pr->nfree++;
+	/* keep one slot empty so the search above always stops */
+	if (ks->ks_site != 0 || kprof_nsites == KPROF_NSITES - 1) {
+		return &kprof_othersite;
+	}
+	ks->ks_site = site;
+	ks->ks_blksize = blksize;
+	kprof_nsites++;
+	return ks;
+}
 
-	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
-	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
-		/* Whole page is free. */
-		remove_lists(pr, blktype);
-		freepageref(pr);
-		/* Call free_kpages without kmalloc_spinlock. */
-		spinlock_release(&kmalloc_spinlock);
-		free_kpages(prpage);
+/*
+ * Charge the block at ADDR, of BLKSIZE bytes, to SITE.
+ */
+static
+void
+kprof_alloc(vaddr_t addr, size_t blksize, vaddr_t site)
+{
+	struct kprof_site *ks;
+	struct kprof_block *kb;
+	unsigned h;
+
+	spinlock_acquire(&kprof_lock);
+	if (!kprof_on) {
+		/* turned off since the caller looked */
+		spinlock_release(&kprof_lock);
+		return;
+	}
+	ks = kprof_findsite(site, blksize);
+	ks->ks_allocs++;
+	kb = kprof_freeblocks;
+	if (kb == NULL) {
+		kprof_unfollowed++;
 	}
 	else {
-		spinlock_release(&kmalloc_spinlock);
+		kprof_freeblocks = kb->kb_next;
+		kb->kb_addr = addr;
+		kb->kb_blksize = blksize;
+		kb->kb_site = ks;
+		h = KPROF_BLOCKHASH(addr);
+		kb->kb_next = kprof_hash[h];
+		kprof_hash[h] = kb;
+		kprof_nblocks++;
+		ks->ks_livebytes += blksize;
 	}
+	spinlock_release(&kprof_lock);
+}
 
-#ifdef SLOWER /* Don't get the lock unless checksubpages does something. */
-	spinlock_acquire(&kmalloc_spinlock);
-	checksubpages();
-	spinlock_release(&kmalloc_spinlock);
-#endif
+/*
+ * Credit the block at ADDR back to its site, if it's being followed.
+ * Must be called before the block is actually freed, so that nobody
+ * else can have been given it yet.
+ */
+static
+void
+kprof_free(vaddr_t addr)
+{
+	struct kprof_block **p, *kb;
+
+	spinlock_acquire(&kprof_lock);
+	for (p = &kprof_hash[KPROF_BLOCKHASH(addr)]; *p != NULL;
+	     p = &(*p)->kb_next) {
+		kb = *p;
+		if (kb->kb_addr == addr) {
+			*p = kb->kb_next;
+			kb->kb_site->ks_frees++;
+			KASSERT(kb->kb_site->ks_livebytes >= kb->kb_blksize);
+			kb->kb_site->ks_livebytes -= kb->kb_blksize;
+			kb->kb_next = kprof_freeblocks;
+			kprof_freeblocks = kb;
+			kprof_nblocks--;
+			break;
+		}
+	}
+	spinlock_release(&kprof_lock);
+}
 
-	return 0;
+/*
+ * Turn the profiler on or off. Turning it on the first time starts
+ * from nothing; after that it carries on from where it was.
+ */
+void
+kheap_profile(bool on)
+{
+	spinlock_acquire(&kprof_lock);
+	if (on && !kprof_ready) {
+		kprof_clear();
+	}
+	kprof_on = on;
+	spinlock_release(&kprof_lock);
+}
+
+/*
+ * Throw away what the profiler has gathered. Blocks it was following
+ * are forgotten, and won't be credited back when they're freed.
+ */
+void
+kheap_profreset(void)
+{
+	spinlock_acquire(&kprof_lock);
+	kprof_clear();
+	spinlock_release(&kprof_lock);
+}
+
+/*
+ * Print the N (at most KPROF_TOP) call sites holding the most live
+ * bytes, with their allocation and free counts. The addresses can be
+ * turned into function names with addr2line on the kernel image.
+ */
+void
+kheap_profprint(unsigned n)
+{
+	struct kprof_site top[KPROF_TOP];
+	struct kprof_site *ks;
+	unsigned i, j, ntop, nsites, nblocks, unfollowed;
+	size_t live;
+	bool on;
+
+	if (n > KPROF_TOP) {
+		n = KPROF_TOP;
+	}
+
+	/* Pick out the top N, sorted, and print them without the lock. */
+	ntop = 0;
+	live = 0;
+	spinlock_acquire(&kprof_lock);
+	for (i = 0; i <= KPROF_NSITES && kprof_ready; i++) {
+		ks = i < KPROF_NSITES ? &kprof_sites[i] : &kprof_othersite;
+		if (ks->ks_allocs == 0) {
+			continue;
+		}
+		live += ks->ks_livebytes;
+		for (j = ntop; j > 0 &&
+			     top[j-1].ks_livebytes < ks->ks_livebytes; j--) {
+			if (j < n) {
+				top[j] = top[j-1];
+			}
+		}
+		if (j < n) {
+			top[j] = *ks;
+			if (ntop < n) {
+				ntop++;
+			}
+		}
+	}
+	on = kprof_on;
+	nsites = kprof_nsites;
+	nblocks = kprof_nblocks;
+	unfollowed = kprof_unfollowed;
+	spinlock_release(&kprof_lock);
+
+	kprintf("kmalloc profile (%s): %u sites, %u blocks live "
+		"(%lu bytes), %u allocations not followed\n",
+		on ? "on" : "off", nsites, nblocks, (unsigned long) live,
+		unfollowed);
+	if (ntop == 0) {
+		return;
+	}
+	kprintf("      site   size  live bytes   allocs    frees\n");
+	for (i = 0; i < ntop; i++) {
+		kprintf("0x%08lx %6lu %11lu %8u %8u\n",
+			(unsigned long) top[i].ks_site,
+			(unsigned long) top[i].ks_blksize,
+			(unsigned long) top[i].ks_livebytes,
+			top[i].ks_allocs, top[i].ks_frees);
+	}
 }
 
-//
 ////////////////////////////////////////////////////////////
 
 /*
@@ -1163,7 +1879,8 @@ subpage_kfree(void *ptr)
 void *
 kmalloc(size_t sz)
 {
-	size_t checksz;
+	size_t checksz, blksize;
+	void *ptr;
 #ifdef LABELS
 	vaddr_t label;
 #endif
@@ -1176,6 +1893,8 @@ kmalloc(size_t sz)
 #endif /* __GNUC__ */
 #endif /* LABELS */
 
+	kmalloc_calls[CURCPU_EXISTS() ? curcpu->c_number : 0]++;
+
 	checksz = sz + GUARD_OVERHEAD + LABEL_OVERHEAD;
 	if (checksz >= LARGEST_SUBPAGE_SIZE) {
 		unsigned long npages;
@@ -1189,14 +1908,26 @@ kmalloc(size_t sz)
 		}
 		KASSERT(address % PAGE_SIZE == 0);
 
-		return (void *)address;
+		ptr = (void *)address;
+		blksize = npages * PAGE_SIZE;
 	}
-
+	else {
 #ifdef LABELS
-	return subpage_kmalloc(sz, label);
+		ptr = subpage_kmalloc(sz, label);
 #else
-	return subpage_kmalloc(sz);
+		ptr = subpage_kmalloc(sz);
 #endif
+		if (ptr == NULL) {
+			return NULL;
+		}
+		blksize = sizes[blocktype(checksz)];
+	}
+
+	if (kprof_on) {
+		kprof_alloc((vaddr_t)ptr, blksize,
+			    (vaddr_t)__builtin_return_address(0));
+	}
+	return ptr;
 }
 
 /*
@@ -1210,7 +1941,11 @@ kfree(void *ptr)
 	 */
 	if (ptr == NULL) {
 		return;
-	} else if (subpage_kfree(ptr)) {
+	}
+	if (kprof_nblocks > 0) {
+		kprof_free((vaddr_t)ptr);
+	}
+	if (subpage_kfree(ptr)) {
 		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
 		free_kpages((vaddr_t)ptr);
 	}
@@ -0,0 +1,230 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <kmemcache.h>
+
+/*
+ * Typed object caches. See kmemcache.h.
+ */
+
+struct kmem_cache {
+	const char *kmc_name;
+	size_t kmc_size;
+	int (*kmc_ctor)(void *obj);
+	void (*kmc_dtor)(void *obj);
+	struct kmem_cache *kmc_next;	// on kmem_caches
+
+	struct spinlock kmc_lock;	// for the rest
+	unsigned kmc_nfree;
+	void *kmc_free[KMEMCACHE_MAX];	// constructed, not in use
+
+	unsigned kmc_inuse;		// objects handed out
+	unsigned kmc_allocs;		// kmem_cache_alloc calls
+	unsigned kmc_hits;		// ...served from kmc_free
+	unsigned kmc_ctorfails;		// ...that failed in the constructor
+	unsigned kmc_overflows;		// frees that found kmc_free full
+	unsigned kmc_reaped;		// objects given back to kmalloc
+};
+
+/* All the caches, newest first, for reaping and statistics */
+static struct spinlock kmem_caches_lock = SPINLOCK_INITIALIZER;
+static struct kmem_cache *kmem_caches;
+
+/*
+ * Get rid of an object for good.
+ */
+static
+void
+kmem_cache_release(struct kmem_cache *kc, void *obj)
+{
+	if (kc->kmc_dtor != NULL) {
+		kc->kmc_dtor(obj);
+	}
+	kfree(obj);
+}
+
+/*
+ * Take every object KC is keeping and release them. Returns how many.
+ */
+static
+unsigned
+kmem_cache_reap(struct kmem_cache *kc)
+{
+	void *objs[KMEMCACHE_MAX];
+	unsigned i, n;
+
+	spinlock_acquire(&kc->kmc_lock);
+	n = kc->kmc_nfree;
+	for (i = 0; i < n; i++) {
+		objs[i] = kc->kmc_free[i];
+	}
+	kc->kmc_nfree = 0;
+	kc->kmc_reaped += n;
+	spinlock_release(&kc->kmc_lock);
+
+	for (i = 0; i < n; i++) {
+		kmem_cache_release(kc, objs[i]);
+	}
+	return n;
+}
+
+struct kmem_cache *
+kmem_cache_create(const char *name, size_t size,
+		  int (*ctor)(void *obj), void (*dtor)(void *obj))
+{
+	struct kmem_cache *kc;
+
+	KASSERT(size > 0);
+
+	kc = kmalloc(sizeof(*kc));
+	if (kc == NULL) {
+		return NULL;
+	}
+	kc->kmc_name = name;
+	kc->kmc_size = size;
+	kc->kmc_ctor = ctor;
+	kc->kmc_dtor = dtor;
+	spinlock_init(&kc->kmc_lock);
+	kc->kmc_nfree = 0;
+	kc->kmc_inuse = 0;
+	kc->kmc_allocs = 0;
+	kc->kmc_hits = 0;
+	kc->kmc_ctorfails = 0;
+	kc->kmc_overflows = 0;
+	kc->kmc_reaped = 0;
+
+	spinlock_acquire(&kmem_caches_lock);
+	kc->kmc_next = kmem_caches;
+	kmem_caches = kc;
+	spinlock_release(&kmem_caches_lock);
+
+	return kc;
+}
+
+void
+kmem_cache_destroy(struct kmem_cache *kc)
+{
+	struct kmem_cache **p;
+
+	spinlock_acquire(&kmem_caches_lock);
+	for (p = &kmem_caches; *p != kc; p = &(*p)->kmc_next) {
+		KASSERT(*p != NULL);
+	}
+	*p = kc->kmc_next;
+	spinlock_release(&kmem_caches_lock);
+
+	kmem_cache_reap(kc);
+	KASSERT(kc->kmc_inuse == 0);
+	spinlock_cleanup(&kc->kmc_lock);
+	kfree(kc);
+}
+
+void *
+kmem_cache_alloc(struct kmem_cache *kc)
+{
+	void *obj = NULL;
+	int result;
+
+	spinlock_acquire(&kc->kmc_lock);
+	kc->kmc_allocs++;
+	if (kc->kmc_nfree > 0) {
+		obj = kc->kmc_free[--kc->kmc_nfree];
+		kc->kmc_hits++;
+		kc->kmc_inuse++;
+	}
+	spinlock_release(&kc->kmc_lock);
+	if (obj != NULL) {
+		return obj;
+	}
+
+	/* Make a new one. */
+	obj = kmalloc(kc->kmc_size);
+	if (obj == NULL) {
+		return NULL;
+	}
+	if (kc->kmc_ctor != NULL) {
+		result = kc->kmc_ctor(obj);
+		if (result) {
+			kfree(obj);
+			spinlock_acquire(&kc->kmc_lock);
+			kc->kmc_ctorfails++;
+			spinlock_release(&kc->kmc_lock);
+			return NULL;
+		}
+	}
+
+	spinlock_acquire(&kc->kmc_lock);
+	kc->kmc_inuse++;
+	spinlock_release(&kc->kmc_lock);
+	return obj;
+}
+
+void
+kmem_cache_free(struct kmem_cache *kc, void *obj)
+{
+	bool kept = false;
+
+	if (obj == NULL) {
+		return;
+	}
+
+	spinlock_acquire(&kc->kmc_lock);
+	KASSERT(kc->kmc_inuse > 0);
+	kc->kmc_inuse--;
+	if (kc->kmc_nfree < KMEMCACHE_MAX) {
+		kc->kmc_free[kc->kmc_nfree++] = obj;
+		kept = true;
+	}
+	else {
+		kc->kmc_overflows++;
+	}
+	spinlock_release(&kc->kmc_lock);
+
+	if (!kept) {
+		kmem_cache_release(kc, obj);
+	}
+}
+
+/*
+ * The list is only walked under kmem_caches_lock, so reap each cache
+ * with it dropped; caches are only destroyed by their owners, which
+ * don't do that while memory is being reclaimed.
+ */
+unsigned
+kmem_cache_reapall(void)
+{
+	struct kmem_cache *kc;
+	unsigned total = 0;
+
+	spinlock_acquire(&kmem_caches_lock);
+	kc = kmem_caches;
+	spinlock_release(&kmem_caches_lock);
+
+	for (; kc != NULL; kc = kc->kmc_next) {
+		total += kmem_cache_reap(kc);
+	}
+	return total;
+}
+
+void
+kmem_cache_printstats(void)
+{
+	struct kmem_cache *kc;
+
+	kprintf("%-12s %5s %5s %5s %8s %8s %5s %5s\n", "cache", "size",
+		"inuse", "kept", "allocs", "hits", "over", "reap");
+	spinlock_acquire(&kmem_caches_lock);
+	for (kc = kmem_caches; kc != NULL; kc = kc->kmc_next) {
+		kprintf("%-12s %5lu %5u %5u %8u %8u %5u %5u\n",
+			kc->kmc_name, (unsigned long) kc->kmc_size,
+			kc->kmc_inuse, kc->kmc_nfree, kc->kmc_allocs,
+			kc->kmc_hits, kc->kmc_overflows, kc->kmc_reaped);
+		if (kc->kmc_ctorfails > 0) {
+			kprintf("%-12s %u constructor failures\n", "",
+				kc->kmc_ctorfails);
+		}
+	}
+	spinlock_release(&kmem_caches_lock);
+	kprintf("kmalloc calls so far: %u\n", kheap_nallocs());
+}
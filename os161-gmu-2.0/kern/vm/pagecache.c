@@ -0,0 +1,331 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <uio.h>
+#include <vnode.h>
+#include <vm.h>
+#include <pagecache.h>
+
+/*
+ * Page cache for mapped files. See pagecache.h.
+ *
+ * Each cache has an array indexed by page number within the file.
+ * An entry is 0 if the page isn't cached, or its frame with PCE_DIRTY
+ * in the low bits. The entries, the list of caches and each vnode's
+ * vn_pagecache are protected by pagecache_lock, which the reclaimer
+ * can take from inside alloc_kpages. Reading pages in, writing them
+ * back and growing the array are serialized per cache by pc_lock, and
+ * are done without pagecache_lock held since they sleep or allocate.
+ */
+
+#define PCE_DIRTY	0x1
+#define PCE_PADDR(e)	((paddr_t)((e) & PAGE_FRAME))
+
+/* pages the reclaimer frees per call */
+#define PC_RECLAIM_BATCH	8
+
+struct pagecache {
+	struct vnode *pc_vn;
+	unsigned pc_refcount;		/* mappings using this cache */
+	struct lock *pc_lock;
+	paddr_t *pc_pages;		/* entries, see above */
+	unsigned pc_npages;		/* size of pc_pages */
+	struct pagecache *pc_next;	/* on pagecache_list */
+};
+
+static struct spinlock pagecache_lock = SPINLOCK_INITIALIZER;
+static struct pagecache *pagecache_list;
+
+int
+pagecache_get(struct vnode *vn, struct pagecache **ret)
+{
+	struct pagecache *pc;
+
+	spinlock_acquire(&pagecache_lock);
+	pc = vn->vn_pagecache;
+	if (pc != NULL) {
+		pc->pc_refcount++;
+		spinlock_release(&pagecache_lock);
+		*ret = pc;
+		return 0;
+	}
+	spinlock_release(&pagecache_lock);
+
+	pc = kmalloc(sizeof(*pc));
+	if (pc == NULL) {
+		return ENOMEM;
+	}
+	pc->pc_lock = lock_create("pagecache");
+	if (pc->pc_lock == NULL) {
+		kfree(pc);
+		return ENOMEM;
+	}
+	pc->pc_vn = vn;
+	pc->pc_refcount = 1;
+	pc->pc_pages = NULL;
+	pc->pc_npages = 0;
+
+	spinlock_acquire(&pagecache_lock);
+	if (vn->vn_pagecache != NULL) {
+		/* somebody else got there first */
+		vn->vn_pagecache->pc_refcount++;
+		*ret = vn->vn_pagecache;
+		spinlock_release(&pagecache_lock);
+		lock_destroy(pc->pc_lock);
+		kfree(pc);
+		return 0;
+	}
+	vn->vn_pagecache = pc;
+	pc->pc_next = pagecache_list;
+	pagecache_list = pc;
+	spinlock_release(&pagecache_lock);
+
+	VOP_INCREF(vn);
+	*ret = pc;
+	return 0;
+}
+
+void
+pagecache_incref(struct pagecache *pc)
+{
+	spinlock_acquire(&pagecache_lock);
+	KASSERT(pc->pc_refcount > 0);
+	pc->pc_refcount++;
+	spinlock_release(&pagecache_lock);
+}
+
+void
+pagecache_release(struct pagecache *pc)
+{
+	struct pagecache **pp;
+	unsigned i;
+
+	spinlock_acquire(&pagecache_lock);
+	KASSERT(pc->pc_refcount > 0);
+	pc->pc_refcount--;
+	if (pc->pc_refcount > 0) {
+		spinlock_release(&pagecache_lock);
+		return;
+	}
+	/* Nobody can find it any more; it's all ours */
+	pc->pc_vn->vn_pagecache = NULL;
+	for (pp = &pagecache_list; *pp != pc; pp = &(*pp)->pc_next) {
+		KASSERT(*pp != NULL);
+	}
+	*pp = pc->pc_next;
+	spinlock_release(&pagecache_lock);
+
+	/* Errors here have nowhere to go; the data is as lost as it gets */
+	(void)pagecache_sync(pc, 0, pc->pc_npages);
+	for (i = 0; i < pc->pc_npages; i++) {
+		if (pc->pc_pages[i] != 0) {
+			free_upage(PCE_PADDR(pc->pc_pages[i]));
+		}
+	}
+	VOP_DECREF(pc->pc_vn);
+	kfree(pc->pc_pages);
+	lock_destroy(pc->pc_lock);
+	kfree(pc);
+}
+
+/*
+ * Make room for entries up to NPAGES. Call with pc_lock held.
+ */
+static
+int
+pagecache_grow(struct pagecache *pc, unsigned npages)
+{
+	paddr_t *newpages, *oldpages;
+	unsigned i, newsize;
+
+	if (npages <= pc->pc_npages) {
+		return 0;
+	}
+	newsize = pc->pc_npages * 2;
+	if (newsize < npages) {
+		newsize = npages;
+	}
+	newpages = kmalloc(newsize * sizeof(paddr_t));
+	if (newpages == NULL) {
+		return ENOMEM;
+	}
+
+	spinlock_acquire(&pagecache_lock);
+	for (i = 0; i < pc->pc_npages; i++) {
+		newpages[i] = pc->pc_pages[i];
+	}
+	for (; i < newsize; i++) {
+		newpages[i] = 0;
+	}
+	oldpages = pc->pc_pages;
+	pc->pc_pages = newpages;
+	pc->pc_npages = newsize;
+	spinlock_release(&pagecache_lock);
+
+	kfree(oldpages);
+	return 0;
+}
+
+int
+pagecache_getpage(struct pagecache *pc, unsigned index, paddr_t *ret)
+{
+	struct iovec iov;
+	struct uio ku;
+	paddr_t paddr;
+	vaddr_t kva;
+	int result;
+
+	lock_acquire(pc->pc_lock);
+	result = pagecache_grow(pc, index + 1);
+	if (result) {
+		lock_release(pc->pc_lock);
+		return result;
+	}
+
+	spinlock_acquire(&pagecache_lock);
+	if (pc->pc_pages[index] != 0) {
+		paddr = PCE_PADDR(pc->pc_pages[index]);
+		upage_incref(paddr);
+		spinlock_release(&pagecache_lock);
+		lock_release(pc->pc_lock);
+		*ret = paddr;
+		return 0;
+	}
+	spinlock_release(&pagecache_lock);
+
+	paddr = alloc_upage();
+	if (paddr == 0) {
+		lock_release(pc->pc_lock);
+		return ENOMEM;
+	}
+	kva = PADDR_TO_KVADDR(paddr);
+	uio_kinit(&iov, &ku, (void *)kva, PAGE_SIZE,
+		  (off_t)index * PAGE_SIZE, UIO_READ);
+	result = VOP_READ(pc->pc_vn, &ku);
+	if (result) {
+		free_upage(paddr);
+		lock_release(pc->pc_lock);
+		return result;
+	}
+	/* past end of file */
+	bzero((void *)(kva + PAGE_SIZE - ku.uio_resid), ku.uio_resid);
+
+	/* one reference for the cache, one for the caller */
+	spinlock_acquire(&pagecache_lock);
+	pc->pc_pages[index] = paddr;
+	upage_incref(paddr);
+	spinlock_release(&pagecache_lock);
+	lock_release(pc->pc_lock);
+
+	*ret = paddr;
+	return 0;
+}
+
+void
+pagecache_dirty(struct pagecache *pc, unsigned index)
+{
+	spinlock_acquire(&pagecache_lock);
+	KASSERT(index < pc->pc_npages && pc->pc_pages[index] != 0);
+	pc->pc_pages[index] |= PCE_DIRTY;
+	spinlock_release(&pagecache_lock);
+}
+
+bool
+pagecache_isdirty(struct pagecache *pc, unsigned index)
+{
+	bool ret;
+
+	spinlock_acquire(&pagecache_lock);
+	ret = index < pc->pc_npages && (pc->pc_pages[index] & PCE_DIRTY);
+	spinlock_release(&pagecache_lock);
+	return ret;
+}
+
+int
+pagecache_sync(struct pagecache *pc, unsigned start, unsigned npages)
+{
+	struct iovec iov;
+	struct uio ku;
+	struct stat st;
+	paddr_t entry;
+	off_t pos;
+	size_t len;
+	unsigned i;
+	int result;
+
+	lock_acquire(pc->pc_lock);
+	result = VOP_STAT(pc->pc_vn, &st);
+	if (result) {
+		lock_release(pc->pc_lock);
+		return result;
+	}
+	for (i = start; i < start + npages && i < pc->pc_npages; i++) {
+		/* only we change entries while pc_lock is held, bar the
+		   reclaimer, which leaves dirty ones alone */
+		entry = pc->pc_pages[i];
+		if ((entry & PCE_DIRTY) == 0) {
+			continue;
+		}
+
+		/* Writes past end of file aren't kept */
+		pos = (off_t)i * PAGE_SIZE;
+		if (pos < st.st_size) {
+			len = PAGE_SIZE;
+			if (st.st_size - pos < PAGE_SIZE) {
+				len = st.st_size - pos;
+			}
+			uio_kinit(&iov, &ku,
+				  (void *)PADDR_TO_KVADDR(PCE_PADDR(entry)),
+				  len, pos, UIO_WRITE);
+			result = VOP_WRITE(pc->pc_vn, &ku);
+			if (result) {
+				lock_release(pc->pc_lock);
+				return result;
+			}
+		}
+
+		spinlock_acquire(&pagecache_lock);
+		if (!upage_shared(PCE_PADDR(entry))) {
+			pc->pc_pages[i] &= ~(paddr_t)PCE_DIRTY;
+		}
+		spinlock_release(&pagecache_lock);
+	}
+	lock_release(pc->pc_lock);
+	return 0;
+}
+
+unsigned
+pagecache_reclaim(void)
+{
+	struct pagecache *pc;
+	paddr_t freed[PC_RECLAIM_BATCH];
+	paddr_t entry;
+	unsigned i, n;
+
+	n = 0;
+	spinlock_acquire(&pagecache_lock);
+	for (pc = pagecache_list; pc != NULL; pc = pc->pc_next) {
+		for (i = 0; i < pc->pc_npages; i++) {
+			entry = pc->pc_pages[i];
+			if (entry == 0 || (entry & PCE_DIRTY) ||
+			    upage_shared(PCE_PADDR(entry))) {
+				continue;
+			}
+			pc->pc_pages[i] = 0;
+			freed[n++] = PCE_PADDR(entry);
+			if (n == PC_RECLAIM_BATCH) {
+				goto done;
+			}
+		}
+	}
+ done:
+	spinlock_release(&pagecache_lock);
+
+	for (i = 0; i < n; i++) {
+		free_upage(freed[i]);
+	}
+	return n;
+}
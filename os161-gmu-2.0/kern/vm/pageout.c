@@ -0,0 +1,139 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <thread.h>
+#include <vm.h>
+#include <swap.h>
+#include <pagecache.h>
+#include <pageout.h>
+
+/*
+ * Pageout daemon. See pageout.h.
+ */
+
+/*
+ * pageout_lock goes with the daemon's wait channel. The watermarks
+ * are only changed under it, though alloc_kpages reads the low one
+ * without it; a stale value costs one wakeup more or less.
+ */
+static struct spinlock pageout_lock = SPINLOCK_INITIALIZER;
+static struct wchan *pageout_wchan;	/* NULL until the daemon starts */
+
+unsigned pageout_lowater;
+static unsigned pageout_hiwater;
+
+/* Statistics, only written by the daemon */
+static unsigned pageout_wakeups;	/* times it went to work */
+static unsigned pageout_dropped;	/* clean cache pages freed */
+static unsigned pageout_evicted;	/* pages pushed out to swap */
+static unsigned pageout_stalls;		/* times it gave up short */
+
+/*
+ * One pass: free frames until the high watermark is reached, the
+ * cheapest way first. Returns false if we ran out of things to free.
+ */
+static
+bool
+pageout_pass(void)
+{
+	unsigned n;
+
+	while (vm_freepages() < pageout_hiwater) {
+		n = pagecache_reclaim();
+		if (n > 0) {
+			pageout_dropped += n;
+			continue;
+		}
+		if (swap_evict()) {
+			return false;
+		}
+		pageout_evicted++;
+	}
+	return true;
+}
+
+static
+void
+pageout_thread(void *unused1, unsigned long unused2)
+{
+	(void)unused1;
+	(void)unused2;
+
+	while (1) {
+		spinlock_acquire(&pageout_lock);
+		while (vm_freepages() >= pageout_lowater) {
+			wchan_sleep(pageout_wchan, &pageout_lock);
+		}
+		spinlock_release(&pageout_lock);
+
+		pageout_wakeups++;
+		if (!pageout_pass()) {
+			/* Swap is full or off; let things settle */
+			pageout_stalls++;
+			clocksleep(1);
+		}
+	}
+}
+
+void
+pageout_bootstrap(void)
+{
+	int result;
+
+	/* About 3% of memory, and twice that once we start */
+	pageout_lowater = TOTAL_PAGES / 32;
+	if (pageout_lowater < 4) {
+		pageout_lowater = 4;
+	}
+	pageout_hiwater = 2 * pageout_lowater;
+
+	pageout_wchan = wchan_create("pageout");
+	if (pageout_wchan == NULL) {
+		panic("pageout: Out of memory creating wait channel\n");
+	}
+	result = thread_fork("pageout", NULL, pageout_thread, NULL, 0);
+	if (result) {
+		panic("pageout: thread_fork: %s\n", strerror(result));
+	}
+}
+
+void
+pageout_wakeup(void)
+{
+	if (pageout_wchan == NULL) {
+		return;
+	}
+	spinlock_acquire(&pageout_lock);
+	wchan_wakeone(pageout_wchan, &pageout_lock);
+	spinlock_release(&pageout_lock);
+}
+
+int
+pageout_setwater(unsigned low, unsigned high)
+{
+	if (low == 0 || low > high || high >= TOTAL_PAGES) {
+		return EINVAL;
+	}
+	spinlock_acquire(&pageout_lock);
+	pageout_lowater = low;
+	pageout_hiwater = high;
+	spinlock_release(&pageout_lock);
+
+	/* It may be below the new low watermark already */
+	pageout_wakeup();
+	return 0;
+}
+
+void
+pageout_printstats(void)
+{
+	kprintf("watermarks:     %u low, %u high (%u free)\n",
+		pageout_lowater, pageout_hiwater, vm_freepages());
+	kprintf("pageout runs:   %u (%u gave up)\n", pageout_wakeups,
+		pageout_stalls);
+	kprintf("  evicted:      %u\n", pageout_evicted);
+	kprintf("  cache drops:  %u\n", pageout_dropped);
+}
@@ -0,0 +1,212 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vm.h>
+#include <pagetable.h>
+#include <swap.h>
+
+/*
+ * Two-level page table for user address spaces. See pagetable.h.
+ */
+
+static struct pagetable *pt_slots[PT_MAXSLOTS + 1];
+static struct spinlock pt_slotlock = SPINLOCK_INITIALIZER;
+
+struct pagetable *
+pagetable_create(void)
+{
+	struct pagetable *pt;
+	unsigned i;
+
+	pt = kmalloc(sizeof(*pt));
+	if (pt == NULL) {
+		return NULL;
+	}
+	for (i = 0; i < PT_NENTRIES; i++) {
+		pt->pt_dir[i] = NULL;
+	}
+	pt->pt_asid = 0;
+	pt->pt_asidgen = 0;
+	pt->pt_cpus = 0;
+
+	spinlock_acquire(&pt_slotlock);
+	for (i = 1; i <= PT_MAXSLOTS; i++) {
+		if (pt_slots[i] == NULL) {
+			pt_slots[i] = pt;
+			break;
+		}
+	}
+	spinlock_release(&pt_slotlock);
+	if (i > PT_MAXSLOTS) {
+		kfree(pt);
+		return NULL;
+	}
+	pt->pt_slot = i;
+	return pt;
+}
+
+void
+pagetable_destroy(struct pagetable *pt)
+{
+	unsigned i, j;
+	pte_t *tbl;
+
+	/* The pager may be holding one of our pages; wait for it */
+	swap_lock_acquire();
+	for (i = 0; i < PT_NENTRIES; i++) {
+		tbl = pt->pt_dir[i];
+		if (tbl == NULL) {
+			continue;
+		}
+		for (j = 0; j < PT_NENTRIES; j++) {
+			if (tbl[j] & PTE_VALID) {
+				free_upage(PTE_PADDR(tbl[j]));
+			}
+			else if (tbl[j] & PTE_SWAPPED) {
+				swap_drop(tbl[j]);
+			}
+		}
+		kfree(tbl);
+	}
+	swap_lock_release();
+
+	spinlock_acquire(&pt_slotlock);
+	KASSERT(pt_slots[pt->pt_slot] == pt);
+	pt_slots[pt->pt_slot] = NULL;
+	spinlock_release(&pt_slotlock);
+	kfree(pt);
+}
+
+void
+pagetable_unmap(struct pagetable *pt, vaddr_t start, unsigned npages)
+{
+	vaddr_t va;
+	pte_t *pte;
+	unsigned i;
+
+	swap_lock_acquire();
+	/* Nobody may reach the frames through a stale TLB entry once freed */
+	vm_tlbshootdown_range(pt, start, npages);
+	for (i = 0; i < npages; i++) {
+		va = start + i * PAGE_SIZE;
+		pte = pagetable_lookup(pt, va);
+		if (pte == NULL) {
+			/* skip the rest of this 4M block */
+			i += PT_NENTRIES - 1 - PT_TBL_INDEX(va);
+			continue;
+		}
+		if (*pte & PTE_VALID) {
+			free_upage(PTE_PADDR(*pte));
+		}
+		else if (*pte & PTE_SWAPPED) {
+			swap_drop(*pte);
+		}
+		*pte = 0;
+	}
+	swap_lock_release();
+}
+
+pte_t *
+pagetable_lookup(struct pagetable *pt, vaddr_t va)
+{
+	pte_t *tbl;
+
+	tbl = pt->pt_dir[PT_DIR_INDEX(va)];
+	if (tbl == NULL) {
+		return NULL;
+	}
+	return &tbl[PT_TBL_INDEX(va)];
+}
+
+int
+pagetable_getpte(struct pagetable *pt, vaddr_t va, pte_t **ret)
+{
+	pte_t *tbl;
+	unsigned i;
+
+	tbl = pt->pt_dir[PT_DIR_INDEX(va)];
+	if (tbl == NULL) {
+		tbl = kmalloc(PT_NENTRIES * sizeof(pte_t));
+		if (tbl == NULL) {
+			return ENOMEM;
+		}
+		for (i = 0; i < PT_NENTRIES; i++) {
+			tbl[i] = 0;
+		}
+		pt->pt_dir[PT_DIR_INDEX(va)] = tbl;
+	}
+	*ret = &tbl[PT_TBL_INDEX(va)];
+	return 0;
+}
+
+int
+pagetable_copy(struct pagetable *src, struct pagetable *dst)
+{
+	unsigned i, j;
+	vaddr_t va;
+	paddr_t newpa;
+	pte_t *pte;
+	int result;
+
+	/*
+	 * Entries are looked at and shared with the swap lock held, so
+	 * the pager can't evict or move a page between our testing its
+	 * entry and taking a reference on its frame. It's dropped around
+	 * allocations, which may need the pager to make room; nobody but
+	 * us changes a swapped-out entry of ours meanwhile.
+	 */
+	for (i = 0; i < PT_NENTRIES; i++) {
+		if (src->pt_dir[i] == NULL) {
+			continue;
+		}
+		/* make DST's table for these entries before locking */
+		result = pagetable_getpte(dst, i << 22, &pte);
+		if (result) {
+			return result;
+		}
+		swap_lock_acquire();
+		for (j = 0; j < PT_NENTRIES; j++) {
+			KASSERT((src->pt_dir[i][j] & PTE_MOVING) == 0);
+			if ((src->pt_dir[i][j] & (PTE_VALID|PTE_SWAPPED)) == 0) {
+				continue;
+			}
+			va = (i << 22) | (j << 12);
+			pte = pagetable_lookup(dst, va);
+			KASSERT(pte != NULL);
+			if (src->pt_dir[i][j] & PTE_SWAPPED) {
+				swap_lock_release();
+				newpa = alloc_upage();
+				if (newpa == 0) {
+					return ENOMEM;
+				}
+				swap_lock_acquire();
+				KASSERT(src->pt_dir[i][j] & PTE_SWAPPED);
+				result = swap_pagecopy(src->pt_dir[i][j], newpa);
+				if (result) {
+					swap_lock_release();
+					free_upage(newpa);
+					return result;
+				}
+				*pte = newpa | PTE_VALID;
+				upage_setowner(newpa, dst, va);
+				continue;
+			}
+			if ((src->pt_dir[i][j] & PTE_FILE) == 0) {
+				src->pt_dir[i][j] |= PTE_COW;
+			}
+			*pte = src->pt_dir[i][j];
+			upage_incref(PTE_PADDR(*pte));
+		}
+		swap_lock_release();
+	}
+	return 0;
+}
+
+struct pagetable *
+pagetable_byslot(unsigned slot)
+{
+	KASSERT(slot > 0 && slot <= PT_MAXSLOTS);
+	KASSERT(pt_slots[slot] != NULL);
+	return pt_slots[slot];
+}
@@ -0,0 +1,515 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <bitmap.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <cpu.h>
+#include <thread.h>
+#include <current.h>
+#include <proc.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <pagetable.h>
+#include <swap.h>
+
+/*
+ * Swap space and page replacement. See swap.h.
+ */
+
+#define SWAP_DEVICE	"lhd1raw:"
+
+static struct vnode *swap_vn;		/* NULL if we have no swap */
+static struct bitmap *swap_map;		/* slots in use */
+static struct spinlock swap_maplock = SPINLOCK_INITIALIZER;
+
+/*
+ * Held for the whole of an eviction and around every read from swap,
+ * so a page being written out can't be read back (or its page table
+ * freed) until the write has finished. Pages moved by compaction are
+ * moved under it too.
+ */
+static struct lock *swap_lk;
+
+static unsigned swap_nevicted;		/* pages written out; under swap_lk */
+
+/*
+ * Replacement policies. Each picks a victim among the frames that
+ * can be evicted (unshared user frames with an owner), with
+ * coremap_lock held, and returns its coremap index or -1. The
+ * reference bit in the coremap word is set by every fault on the
+ * page; a policy that clears it must drop the TLB entry too, so the
+ * next use faults and sets it again. Policies may keep one word per
+ * frame in swap_frameinfo, which rp_mapped can set when a frame gets
+ * a new owner and which is zeroed when the policy changes.
+ */
+struct replpolicy {
+	const char *rp_name;
+	void (*rp_mapped)(unsigned i);
+	int (*rp_victim)(void);
+};
+
+static unsigned swap_hand;		/* clock hand, index into coremap */
+static uint32_t *swap_frameinfo;	/* per-frame policy data */
+static uint32_t swap_fifoseq;		/* FIFO arrival counter */
+
+void
+swap_bootstrap(void)
+{
+	char path[] = SWAP_DEVICE;
+	struct stat st;
+	unsigned nslots;
+	int result;
+
+	/* Compaction moves pages under this lock even without swap */
+	swap_lk = lock_create("swap");
+	if (swap_lk == NULL) {
+		panic("swap: Out of memory creating lock\n");
+	}
+
+	result = vfs_open(path, O_RDWR, 0, &swap_vn);
+	if (result) {
+		kprintf("swap: %s: %s; paging disabled\n", SWAP_DEVICE,
+			strerror(result));
+		swap_vn = NULL;
+		return;
+	}
+
+	result = VOP_STAT(swap_vn, &st);
+	if (result) {
+		panic("swap: stat %s: %s\n", SWAP_DEVICE, strerror(result));
+	}
+	nslots = st.st_size / PAGE_SIZE;
+
+	swap_map = bitmap_create(nslots);
+	if (swap_map == NULL) {
+		panic("swap: Out of memory creating slot map\n");
+	}
+	swap_frameinfo = kmalloc(TOTAL_PAGES * sizeof(uint32_t));
+	if (swap_frameinfo == NULL) {
+		panic("swap: Out of memory creating frame info\n");
+	}
+	bzero(swap_frameinfo, TOTAL_PAGES * sizeof(uint32_t));
+
+	kprintf("swap: %u pages on %s\n", nslots, SWAP_DEVICE);
+}
+
+static
+int
+swap_io(paddr_t paddr, unsigned slot, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio ku;
+
+	uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE,
+		  (off_t)slot * PAGE_SIZE, rw);
+	if (rw == UIO_READ) {
+		return VOP_READ(swap_vn, &ku);
+	}
+	return VOP_WRITE(swap_vn, &ku);
+}
+
+static
+void
+swap_freeslot(unsigned slot)
+{
+	spinlock_acquire(&swap_maplock);
+	KASSERT(bitmap_isset(swap_map, slot));
+	bitmap_unmark(swap_map, slot);
+	spinlock_release(&swap_maplock);
+}
+
+/*
+ * Shared (copy-on-write) frames have no single owner to update and
+ * are never evicted, nor are kernel frames or user frames that nobody
+ * has claimed yet.
+ */
+static
+bool
+swap_evictable(cme_t w)
+{
+	return CM_STATE(w) == CM_USER && CM_LOW(w) != 0;
+}
+
+/*
+ * Clear frame I's reference bit and drop its TLB entry. Only this
+ * CPU's entry is dropped: a page in use elsewhere may look idle and
+ * get evicted early, but eviction itself shoots it down everywhere,
+ * so that costs a fault, not correctness.
+ */
+static
+void
+swap_clearref(unsigned i)
+{
+	cme_t w = coremap[i];
+
+	coremap[i] = w & ~CM_REF;
+	vm_tlbinvalidate(pagetable_byslot(CM_LOW(w)), CM_HIGH(w) << 12);
+}
+
+static
+void
+clock_mapped(unsigned i)
+{
+	(void)i;
+}
+
+/*
+ * Clock sweep. A referenced page has its bit cleared; if it hasn't
+ * been touched again by the time the hand comes round, it goes.
+ */
+static
+int
+clock_victim(void)
+{
+	unsigned i, victim;
+
+	for (i = 0; i < 2 * TOTAL_PAGES; i++) {
+		victim = swap_hand;
+		swap_hand = (swap_hand + 1) % TOTAL_PAGES;
+
+		if (!swap_evictable(coremap[victim])) {
+			continue;
+		}
+		if (coremap[victim] & CM_REF) {
+			swap_clearref(victim);
+			continue;
+		}
+		return victim;
+	}
+	return -1;
+}
+
+/*
+ * FIFO: the page that has been resident longest goes, used or not.
+ * The frame info is the arrival number; the counter wrapping is
+ * ignored.
+ */
+static
+void
+fifo_mapped(unsigned i)
+{
+	swap_frameinfo[i] = ++swap_fifoseq;
+}
+
+static
+int
+fifo_victim(void)
+{
+	unsigned i;
+	int victim = -1;
+
+	for (i = 0; i < TOTAL_PAGES; i++) {
+		if (!swap_evictable(coremap[i])) {
+			continue;
+		}
+		if (victim < 0 ||
+		    swap_frameinfo[i] < swap_frameinfo[victim]) {
+			victim = i;
+		}
+	}
+	return victim;
+}
+
+/*
+ * Aging, an approximation of LRU. Each page has an 8-bit history of
+ * its reference bit; at every eviction all histories are shifted
+ * right with the current bit coming in at the top, and the page with
+ * the smallest history goes. So the "ticks" are evictions rather than
+ * clock interrupts: the more paging, the faster pages age. Ties are
+ * broken by scanning from the clock hand, so they don't always fall
+ * on the same frames.
+ */
+#define AGING_TOP	0x80
+
+static
+void
+aging_mapped(unsigned i)
+{
+	/* The fault that mapped it set its reference bit */
+	swap_frameinfo[i] = 0;
+}
+
+static
+int
+aging_victim(void)
+{
+	unsigned n, i;
+	int victim = -1;
+
+	for (n = 0; n < TOTAL_PAGES; n++) {
+		i = (swap_hand + n) % TOTAL_PAGES;
+		if (!swap_evictable(coremap[i])) {
+			continue;
+		}
+		swap_frameinfo[i] >>= 1;
+		if (coremap[i] & CM_REF) {
+			swap_frameinfo[i] |= AGING_TOP;
+			swap_clearref(i);
+		}
+		if (victim < 0 ||
+		    swap_frameinfo[i] < swap_frameinfo[victim]) {
+			victim = i;
+		}
+	}
+	swap_hand = (swap_hand + 1) % TOTAL_PAGES;
+	return victim;
+}
+
+static const struct replpolicy swap_policies[] = {
+	{ "clock",	clock_mapped,	clock_victim },
+	{ "fifo",	fifo_mapped,	fifo_victim },
+	{ "aging",	aging_mapped,	aging_victim },
+};
+#define NPOLICIES (sizeof(swap_policies) / sizeof(swap_policies[0]))
+
+static const struct replpolicy *swap_policy = &swap_policies[0];
+
+/*
+ * Pick a victim with the current policy. Returns the coremap index
+ * and where the page is mapped, or -1.
+ */
+static
+int
+swap_victim(struct pagetable **pt, vaddr_t *vaddr)
+{
+	cme_t w;
+	int victim;
+
+	spinlock_acquire(&coremap_lock);
+	victim = swap_policy->rp_victim();
+	if (victim >= 0) {
+		w = coremap[victim];
+		KASSERT(swap_evictable(w));
+		*pt = pagetable_byslot(CM_LOW(w));
+		*vaddr = CM_HIGH(w) << 12;
+	}
+	spinlock_release(&coremap_lock);
+	return victim;
+}
+
+void
+swap_mapped(unsigned i)
+{
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+	if (swap_frameinfo != NULL) {
+		swap_policy->rp_mapped(i);
+	}
+}
+
+int
+swap_setpolicy(const char *name)
+{
+	unsigned i;
+
+	for (i = 0; i < NPOLICIES; i++) {
+		if (!strcmp(name, swap_policies[i].rp_name)) {
+			break;
+		}
+	}
+	if (i == NPOLICIES) {
+		return EINVAL;
+	}
+
+	/* Frames already resident look brand new to the new policy */
+	spinlock_acquire(&coremap_lock);
+	swap_policy = &swap_policies[i];
+	if (swap_frameinfo != NULL) {
+		bzero(swap_frameinfo, TOTAL_PAGES * sizeof(uint32_t));
+	}
+	swap_fifoseq = 0;
+	spinlock_release(&coremap_lock);
+	return 0;
+}
+
+const char *
+swap_policyname(unsigned n)
+{
+	return n < NPOLICIES ? swap_policies[n].rp_name : NULL;
+}
+
+const char *
+swap_curpolicy(void)
+{
+	return swap_policy->rp_name;
+}
+
+unsigned
+swap_evictions(void)
+{
+	return swap_nevicted;
+}
+
+int
+swap_evict(void)
+{
+	struct pagetable *pt;
+	vaddr_t vaddr;
+	paddr_t paddr;
+	pte_t *pte, oldpte;
+	unsigned slot;
+	int victim, result;
+
+	if (swap_vn == NULL) {
+		return ENOMEM;
+	}
+	/* Paging sleeps on disk I/O */
+	if (curthread->t_in_interrupt || curcpu->c_spinlocks > 0 ||
+	    lock_do_i_hold(swap_lk)) {
+		return ENOMEM;
+	}
+
+	lock_acquire(swap_lk);
+
+	victim = swap_victim(&pt, &vaddr);
+	if (victim < 0) {
+		lock_release(swap_lk);
+		return ENOMEM;
+	}
+
+	spinlock_acquire(&swap_maplock);
+	result = bitmap_alloc(swap_map, &slot);
+	spinlock_release(&swap_maplock);
+	if (result) {
+		/* swap is full */
+		lock_release(swap_lk);
+		return ENOMEM;
+	}
+
+	paddr = CM_PADDR(victim);
+
+	pte = pagetable_lookup(pt, vaddr);
+	KASSERT(pte != NULL);
+	KASSERT((*pte & (PTE_VALID | PTE_COW)) == PTE_VALID);
+	KASSERT(PTE_PADDR(*pte) == paddr);
+
+	/*
+	 * Unmap first: if the owner touches the page while it's being
+	 * written it faults and waits on swap_lk for the write to finish.
+	 */
+	oldpte = *pte;
+	*pte = PTE_MKSWAP(slot);
+	vm_tlbshootdown_range(pt, vaddr, 1);
+
+	result = swap_io(paddr, slot, UIO_WRITE);
+	if (result) {
+		*pte = oldpte;
+		swap_freeslot(slot);
+		lock_release(swap_lk);
+		return result;
+	}
+
+	free_upage(paddr);
+	swap_nevicted++;
+	lock_release(swap_lk);
+	return 0;
+}
+
+int
+swap_pagein(pte_t *pte, paddr_t paddr)
+{
+	unsigned slot;
+	int result;
+
+	KASSERT(swap_vn != NULL);
+
+	lock_acquire(swap_lk);
+	KASSERT(*pte & PTE_SWAPPED);
+	slot = PTE_SLOT(*pte);
+	result = swap_io(paddr, slot, UIO_READ);
+	if (result == 0) {
+		*pte = paddr | PTE_VALID;
+		swap_freeslot(slot);
+	}
+	lock_release(swap_lk);
+	return result;
+}
+
+int
+swap_pagecopy(pte_t pte, paddr_t paddr)
+{
+	KASSERT(swap_vn != NULL);
+	KASSERT(pte & PTE_SWAPPED);
+	KASSERT(lock_do_i_hold(swap_lk));
+
+	return swap_io(paddr, PTE_SLOT(pte), UIO_READ);
+}
+
+void
+swap_drop(pte_t pte)
+{
+	KASSERT(pte & PTE_SWAPPED);
+	swap_freeslot(PTE_SLOT(pte));
+}
+
+int
+swap_relocate(unsigned i, paddr_t newpa)
+{
+	struct pagetable *pt;
+	vaddr_t vaddr;
+	paddr_t oldpa;
+	pte_t *pte;
+	cme_t w;
+
+	if (swap_lk == NULL || curthread->t_in_interrupt ||
+	    curcpu->c_spinlocks > 0 || lock_do_i_hold(swap_lk)) {
+		return EBUSY;
+	}
+
+	lock_acquire(swap_lk);
+
+	/* It may have been freed, shared or evicted since it was picked */
+	spinlock_acquire(&coremap_lock);
+	w = coremap[i];
+	if (!swap_evictable(w)) {
+		spinlock_release(&coremap_lock);
+		lock_release(swap_lk);
+		return EBUSY;
+	}
+	pt = pagetable_byslot(CM_LOW(w));
+	vaddr = CM_HIGH(w) << 12;
+	spinlock_release(&coremap_lock);
+
+	oldpa = CM_PADDR(i);
+	pte = pagetable_lookup(pt, vaddr);
+	KASSERT(pte != NULL);
+	KASSERT((*pte & (PTE_VALID | PTE_COW)) == PTE_VALID);
+	KASSERT(PTE_PADDR(*pte) == oldpa);
+
+	/* As in swap_evict, a fault on the page meanwhile waits for us */
+	*pte = PTE_MOVING;
+	vm_tlbshootdown_range(pt, vaddr, 1);
+	memmove((void *)PADDR_TO_KVADDR(newpa),
+		(const void *)PADDR_TO_KVADDR(oldpa), PAGE_SIZE);
+	*pte = newpa | PTE_VALID;
+	upage_setowner(newpa, pt, vaddr);
+
+	/* The old frame is the caller's now; nobody else can pick it */
+	spinlock_acquire(&coremap_lock);
+	coremap[i] = CM_MKWORD(0, 0, 0, CM_USER);
+	spinlock_release(&coremap_lock);
+
+	lock_release(swap_lk);
+	return 0;
+}
+
+void
+swap_lock_acquire(void)
+{
+	if (swap_lk != NULL) {
+		lock_acquire(swap_lk);
+	}
+}
+
+void
+swap_lock_release(void)
+{
+	if (swap_lk != NULL) {
+		lock_release(swap_lk);
+	}
+}
@@ -0,0 +1,24 @@
+#ifndef _SYS_MMAN_H_
+#define _SYS_MMAN_H_
+
+#include <sys/types.h>
+
+/*
+ * Get the PROT_, MAP_ and MS_ constants from the kernel
+ */
+#include <kern/mman.h>
+
+#define MAP_FAILED ((void *)-1)
+
+/*
+ * Map LEN bytes of the file open on FILEHANDLE, starting at OFFSET
+ * (a multiple of the page size), into memory. The kernel picks the
+ * address; ADDR is ignored. Pages are read in as they're touched.
+ */
+void *mmap(void *addr, size_t len, int prot, int flags, int filehandle,
+	   off_t offset);
+int munmap(void *addr, size_t len);
+int msync(void *addr, size_t len, int flags);
+
+
+#endif /* _SYS_MMAN_H_ */
@@ -0,0 +1,92 @@
+/*
+ * forkbench - measure fork latency.
+ *
+ * Usage: forkbench [nforks [pages-written-by-child]]
+ *
+ * The parent first touches a large static buffer so that it has a
+ * sizeable resident image, then forks NFORKS children one at a time.
+ * Each child writes to the given number of pages of the buffer and
+ * exits; the parent waits for it before forking the next. The time
+ * from fork() to the child's exit being collected is averaged.
+ *
+ * With copy-on-write, a child that writes nothing should cost about
+ * the same regardless of how big the buffer is; each page written
+ * adds one page copy.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <err.h>
+
+#define PAGESIZE	4096
+#define BUFPAGES	256
+#define DEFAULT_NFORKS	50
+
+static char buf[BUFPAGES * PAGESIZE];
+
+static
+void
+child(int npages)
+{
+	int i;
+
+	for (i = 0; i < npages; i++) {
+		buf[i * PAGESIZE] = (char)i;
+	}
+	_exit(0);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int nforks = DEFAULT_NFORKS;
+	int npages = 0;
+	int i, status;
+	pid_t pid;
+	time_t s0, s1;
+	unsigned long ns0, ns1;
+	unsigned long long usecs;
+
+	if (argc > 1) {
+		nforks = atoi(argv[1]);
+	}
+	if (argc > 2) {
+		npages = atoi(argv[2]);
+	}
+	if (nforks <= 0 || npages < 0 || npages > BUFPAGES) {
+		errx(1, "Usage: forkbench [nforks [0-%d]]", BUFPAGES);
+	}
+
+	/* make the whole buffer resident in the parent */
+	for (i = 0; i < BUFPAGES; i++) {
+		buf[i * PAGESIZE] = 1;
+	}
+
+	__time(&s0, &ns0);
+	for (i = 0; i < nforks; i++) {
+		pid = fork();
+		if (pid < 0) {
+			err(1, "fork");
+		}
+		if (pid == 0) {
+			child(npages);
+		}
+		if (waitpid(pid, &status, 0) < 0) {
+			err(1, "waitpid");
+		}
+	}
+	__time(&s1, &ns1);
+
+	usecs = (s1 - s0) * 1000000ULL;
+	usecs += ns1 / 1000;
+	usecs -= ns0 / 1000;
+
+	printf("forkbench: %d forks, %d of %d pages written per child\n",
+	       nforks, npages, BUFPAGES);
+	printf("forkbench: %llu us total, %llu us per fork\n",
+	       usecs, usecs / nforks);
+	return 0;
+}
@@ -0,0 +1,186 @@
+/*
+ * mmaptest - test memory-mapped files.
+ *
+ * Usage: mmaptest [npages]
+ *
+ * Writes a file of NPAGES pages with a known pattern, then checks
+ * that:
+ *    - a shared read-only mapping sees the file's contents;
+ *    - a write through a shared mapping reaches the file after
+ *      msync, and after munmap;
+ *    - a write through a private mapping does not;
+ *    - a forked child writing through an inherited shared mapping is
+ *      seen by the parent;
+ *    - unmapping part of a mapping leaves the rest usable.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+
+#define PAGESIZE	4096
+#define DEFAULT_NPAGES	16
+#define FILENAME	"mmaptest.dat"
+
+static char buf[PAGESIZE];
+
+static
+char
+pattern(int page, int off)
+{
+	return (char)(page * 7 + off);
+}
+
+static
+void
+makefile(int npages)
+{
+	int fd, i, j;
+
+	fd = open(FILENAME, O_WRONLY|O_CREAT|O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s: open for write", FILENAME);
+	}
+	for (i = 0; i < npages; i++) {
+		for (j = 0; j < PAGESIZE; j++) {
+			buf[j] = pattern(i, j);
+		}
+		if (write(fd, buf, PAGESIZE) != PAGESIZE) {
+			err(1, "%s: write", FILENAME);
+		}
+	}
+	close(fd);
+}
+
+/* read byte OFF of page PAGE of the file with read() */
+static
+char
+fileat(int fd, int page, int off)
+{
+	char c;
+
+	if (lseek(fd, (off_t)page * PAGESIZE + off, SEEK_SET) < 0) {
+		err(1, "lseek");
+	}
+	if (read(fd, &c, 1) != 1) {
+		err(1, "read");
+	}
+	return c;
+}
+
+static
+char *
+domap(int fd, int npages, int prot, int flags)
+{
+	char *p;
+
+	p = mmap(NULL, npages * PAGESIZE, prot, flags, fd, 0);
+	if (p == MAP_FAILED) {
+		err(1, "mmap");
+	}
+	return p;
+}
+
+int
+main(int argc, char *argv[])
+{
+	int npages = DEFAULT_NPAGES;
+	int fd, i, j, status;
+	char *p;
+	pid_t pid;
+
+	if (argc > 1) {
+		npages = atoi(argv[1]);
+	}
+	if (npages < 2) {
+		errx(1, "Usage: mmaptest [npages >= 2]");
+	}
+
+	makefile(npages);
+	fd = open(FILENAME, O_RDWR);
+	if (fd < 0) {
+		err(1, "%s: open", FILENAME);
+	}
+
+	printf("Reading through a shared mapping...\n");
+	p = domap(fd, npages, PROT_READ, MAP_SHARED);
+	for (i = 0; i < npages; i++) {
+		for (j = 0; j < PAGESIZE; j++) {
+			if (p[i * PAGESIZE + j] != pattern(i, j)) {
+				errx(1, "page %d byte %d is wrong", i, j);
+			}
+		}
+	}
+	if (munmap(p, npages * PAGESIZE)) {
+		err(1, "munmap");
+	}
+
+	printf("Writing through a shared mapping...\n");
+	p = domap(fd, npages, PROT_READ|PROT_WRITE, MAP_SHARED);
+	p[0] = 'a';
+	if (msync(p, npages * PAGESIZE, MS_SYNC)) {
+		err(1, "msync");
+	}
+	if (fileat(fd, 0, 0) != 'a') {
+		errx(1, "write not in file after msync");
+	}
+	p[PAGESIZE + 1] = 'b';
+	if (munmap(p, npages * PAGESIZE)) {
+		err(1, "munmap");
+	}
+	if (fileat(fd, 1, 1) != 'b') {
+		errx(1, "write not in file after munmap");
+	}
+
+	printf("Writing through a private mapping...\n");
+	p = domap(fd, npages, PROT_READ|PROT_WRITE, MAP_PRIVATE);
+	p[2 * PAGESIZE] = 'c';
+	if (p[2 * PAGESIZE] != 'c') {
+		errx(1, "private write lost");
+	}
+	if (munmap(p, npages * PAGESIZE)) {
+		err(1, "munmap");
+	}
+	if (fileat(fd, 2, 0) != pattern(2, 0)) {
+		errx(1, "private write reached the file");
+	}
+
+	printf("Sharing with a child...\n");
+	p = domap(fd, npages, PROT_READ|PROT_WRITE, MAP_SHARED);
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		p[3 * PAGESIZE] = 'd';
+		_exit(0);
+	}
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	if (p[3 * PAGESIZE] != 'd') {
+		errx(1, "parent didn't see child's write");
+	}
+
+	printf("Unmapping the first page...\n");
+	if (munmap(p, PAGESIZE)) {
+		err(1, "munmap");
+	}
+	if (p[PAGESIZE] != 'b') {
+		errx(1, "rest of mapping is wrong after partial munmap");
+	}
+	if (munmap(p + PAGESIZE, (npages - 1) * PAGESIZE)) {
+		err(1, "munmap");
+	}
+
+	close(fd);
+	remove(FILENAME);
+	printf("Passed mmaptest.\n");
+	return 0;
+}